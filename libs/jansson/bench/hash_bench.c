@@ -0,0 +1,162 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/*
+ * Key hashing benchmark over the object keys of a forecast response.
+ *
+ * The raw hashing loop runs both wyhash and lookup3 over the same key
+ * corpus. The lookup loop goes through json_object_getn() and so uses
+ * whichever hash the library was built with; `make bench` builds this
+ * program once per hash (see bench/Makefile) and runs both.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <jansson.h>
+
+#include "lookup3.h"
+#include "wyhash.h"
+
+#define HASH_ROUNDS 200000
+#define LOOKUP_ROUNDS 200000
+
+/* Keys of an hourly/daily forecast as served by the weather API */
+static const char *const forecast_keys[] = {"latitude",
+                                            "longitude",
+                                            "generationtime_ms",
+                                            "utc_offset_seconds",
+                                            "timezone",
+                                            "timezone_abbreviation",
+                                            "elevation",
+                                            "current_units",
+                                            "current",
+                                            "hourly_units",
+                                            "hourly",
+                                            "daily_units",
+                                            "daily",
+                                            "time",
+                                            "interval",
+                                            "temperature_2m",
+                                            "relative_humidity_2m",
+                                            "dew_point_2m",
+                                            "apparent_temperature",
+                                            "precipitation_probability",
+                                            "precipitation",
+                                            "rain",
+                                            "showers",
+                                            "snowfall",
+                                            "snow_depth",
+                                            "weather_code",
+                                            "pressure_msl",
+                                            "surface_pressure",
+                                            "cloud_cover",
+                                            "visibility",
+                                            "wind_speed_10m",
+                                            "wind_direction_10m",
+                                            "wind_gusts_10m",
+                                            "uv_index",
+                                            "is_day",
+                                            "sunrise",
+                                            "sunset",
+                                            "temperature_2m_max",
+                                            "temperature_2m_min",
+                                            "precipitation_sum"};
+
+#define NUM_KEYS (sizeof(forecast_keys) / sizeof(forecast_keys[0]))
+
+static size_t key_lengths[NUM_KEYS];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, double elapsed, size_t count) {
+    printf("%-24s %8.3f s  %6.2f ns/op\n", what, elapsed, elapsed * 1e9 / count);
+}
+
+static void bench_wyhash(void) {
+    volatile uint64_t sink = 0;
+    double start = now();
+    size_t i, j;
+
+    for (i = 0; i < HASH_ROUNDS; i++)
+        for (j = 0; j < NUM_KEYS; j++)
+            sink += wyhash(forecast_keys[j], key_lengths[j], (uint64_t)i);
+
+    report("hash wyhash", now() - start, HASH_ROUNDS * NUM_KEYS);
+    (void)sink;
+}
+
+static void bench_lookup3(void) {
+    volatile uint32_t sink = 0;
+    double start = now();
+    size_t i, j;
+
+    for (i = 0; i < HASH_ROUNDS; i++)
+        for (j = 0; j < NUM_KEYS; j++)
+            sink += hashlittle(forecast_keys[j], key_lengths[j], (uint32_t)i);
+
+    report("hash lookup3", now() - start, HASH_ROUNDS * NUM_KEYS);
+    (void)sink;
+}
+
+static int bench_lookup(void) {
+    json_t *object = json_object();
+    size_t i, j, found = 0;
+    double start;
+
+    if (!object)
+        return -1;
+
+    for (j = 0; j < NUM_KEYS; j++) {
+        if (json_object_setn_new_nocheck(object, forecast_keys[j], key_lengths[j],
+                                         json_integer((json_int_t)j))) {
+            json_decref(object);
+            return -1;
+        }
+    }
+
+    start = now();
+    for (i = 0; i < LOOKUP_ROUNDS; i++)
+        for (j = 0; j < NUM_KEYS; j++)
+            found += json_object_getn(object, forecast_keys[j], key_lengths[j]) != NULL;
+
+#ifdef JANSSON_HASH_LOOKUP3
+    report("lookup (lookup3)", now() - start, LOOKUP_ROUNDS * NUM_KEYS);
+#else
+    report("lookup (wyhash)", now() - start, LOOKUP_ROUNDS * NUM_KEYS);
+#endif
+
+    json_decref(object);
+    return found == LOOKUP_ROUNDS * NUM_KEYS ? 0 : -1;
+}
+
+int main(void) {
+    size_t j;
+
+    json_object_seed(0);
+    for (j = 0; j < NUM_KEYS; j++)
+        key_lengths[j] = strlen(forecast_keys[j]);
+
+    printf("%u forecast keys\n", (unsigned)NUM_KEYS);
+    bench_wyhash();
+    bench_lookup3();
+
+    if (bench_lookup()) {
+        fprintf(stderr, "hash_bench: lookup failed\n");
+        return 1;
+    }
+    return 0;
+}
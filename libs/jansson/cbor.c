@@ -0,0 +1,725 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* CBOR (RFC 8949) encoding and decoding of json_t trees. Numbers are
+   stored in binary, so neither side formats or parses text, and reals
+   take the shortest of the half, single and double precision forms
+   that holds them exactly. The decoder accepts what JSON can
+   represent: indefinite lengths and tags are allowed, tags are
+   ignored, and byte strings, non-string keys and simple values other
+   than true, false and null are errors. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jansson.h"
+#include "jansson_private.h"
+#include "strbuffer.h"
+#include "utf.h"
+
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE 20
+#define CBOR_TRUE 21
+#define CBOR_NULL 22
+#define CBOR_HALF 25
+#define CBOR_SINGLE 26
+#define CBOR_DOUBLE 27
+#define CBOR_INDEFINITE 31
+#define CBOR_BREAK 0xff
+
+#define JSON_INT_MAX ((uint64_t)(((uint64_t)1 << (sizeof(json_int_t) * 8 - 1)) - 1))
+
+/*** encoding ***/
+
+static int put_head(strbuffer_t *out, int major, uint64_t value) {
+    unsigned char buf[9];
+    size_t i, n;
+
+    if (value < 24) {
+        buf[0] = (unsigned char)(major << 5 | value);
+        return strbuffer_append_bytes(out, (char *)buf, 1);
+    }
+
+    if (value <= 0xff)
+        n = 1;
+    else if (value <= 0xffff)
+        n = 2;
+    else if (value <= 0xffffffff)
+        n = 4;
+    else
+        n = 8;
+
+    buf[0] = (unsigned char)(major << 5 | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27));
+    for (i = n; i > 0; i--) {
+        buf[i] = (unsigned char)value;
+        value >>= 8;
+    }
+
+    return strbuffer_append_bytes(out, (char *)buf, n + 1);
+}
+
+/* Half precision bits of value, if it has them exactly */
+static int to_half(double value, uint16_t *half) {
+    float single = (float)value;
+    uint32_t bits, mantissa, sign;
+    int exponent;
+
+    if ((double)single != value)
+        return 0;
+
+    memcpy(&bits, &single, 4);
+    sign = (bits >> 16) & 0x8000;
+    exponent = (int)((bits >> 23) & 0xff) - 127;
+    mantissa = bits & 0x7fffff;
+
+    if (value == 0) {
+        *half = (uint16_t)sign;
+        return 1;
+    }
+
+    if (exponent > 15 || exponent < -24)
+        return 0;
+
+    if (exponent >= -14) {
+        if (mantissa & 0x1fff)
+            return 0;
+        *half = (uint16_t)(sign | (uint32_t)(exponent + 15) << 10 | mantissa >> 13);
+        return 1;
+    }
+
+    /* subnormal */
+    mantissa |= 0x800000;
+    if (mantissa & ((1u << (-1 - exponent)) - 1))
+        return 0;
+    *half = (uint16_t)(sign | mantissa >> (-1 - exponent));
+    return 1;
+}
+
+static int put_real(strbuffer_t *out, double value) {
+    unsigned char buf[9];
+    float single = (float)value;
+    uint16_t half;
+    uint64_t bits;
+    size_t i, n;
+
+    if (to_half(value, &half)) {
+        buf[0] = CBOR_SIMPLE << 5 | CBOR_HALF;
+        bits = half;
+        n = 2;
+    } else if ((double)single == value) {
+        uint32_t bits32;
+        memcpy(&bits32, &single, 4);
+        buf[0] = CBOR_SIMPLE << 5 | CBOR_SINGLE;
+        bits = bits32;
+        n = 4;
+    } else {
+        memcpy(&bits, &value, 8);
+        buf[0] = CBOR_SIMPLE << 5 | CBOR_DOUBLE;
+        n = 8;
+    }
+
+    for (i = n; i > 0; i--) {
+        buf[i] = (unsigned char)bits;
+        bits >>= 8;
+    }
+
+    return strbuffer_append_bytes(out, (char *)buf, n + 1);
+}
+
+static int put_integer(strbuffer_t *out, json_int_t value) {
+    if (value >= 0)
+        return put_head(out, CBOR_UINT, (uint64_t)value);
+    return put_head(out, CBOR_NEGINT, (uint64_t)-(value + 1));
+}
+
+static int put_text(strbuffer_t *out, const char *value, size_t len) {
+    if (put_head(out, CBOR_TEXT, len))
+        return -1;
+    return strbuffer_append_bytes(out, value, len);
+}
+
+static int put_simple(strbuffer_t *out, int value) {
+    char byte = (char)(CBOR_SIMPLE << 5 | value);
+    return strbuffer_append_bytes(out, &byte, 1);
+}
+
+static int encode(const json_t *json, parents_t *parents, strbuffer_t *out) {
+    if (!json)
+        return -1;
+
+    switch (json_typeof(json)) {
+        case JSON_NULL:
+            return put_simple(out, CBOR_NULL);
+
+        case JSON_TRUE:
+            return put_simple(out, CBOR_TRUE);
+
+        case JSON_FALSE:
+            return put_simple(out, CBOR_FALSE);
+
+        case JSON_INTEGER:
+            return put_integer(out, json_integer_value(json));
+
+        case JSON_REAL:
+            return put_real(out, json_real_value(json));
+
+        case JSON_STRING:
+            return put_text(out, json_string_value(json), json_string_length(json));
+
+        case JSON_ARRAY: {
+            size_t i, n = json_array_size(json);
+
+            if (jsonp_loop_check(parents, json) || put_head(out, CBOR_ARRAY, n))
+                return -1;
+
+            for (i = 0; i < n; i++) {
+                json_int_t integer;
+                double real;
+                int res;
+
+                /* don't create json_t values for packed arrays */
+                switch (jsonp_array_packed_value(json, i, &integer, &real)) {
+                    case ARRAY_PACKED_INTEGER:
+                        res = put_integer(out, integer);
+                        break;
+                    case ARRAY_PACKED_REAL:
+                        res = put_real(out, real);
+                        break;
+                    default:
+                        res = encode(json_array_get(json, i), parents, out);
+                        break;
+                }
+                if (res)
+                    return -1;
+            }
+
+            jsonp_loop_leave(parents);
+            return 0;
+        }
+
+        case JSON_OBJECT: {
+            void *iter;
+
+            if (jsonp_loop_check(parents, json) ||
+                put_head(out, CBOR_MAP, json_object_size(json)))
+                return -1;
+
+            for (iter = json_object_iter((json_t *)json); iter;
+                 iter = json_object_iter_next((json_t *)json, iter)) {
+                if (put_text(out, json_object_iter_key(iter),
+                             json_object_iter_key_len(iter)) ||
+                    encode(json_object_iter_value(iter), parents, out))
+                    return -1;
+            }
+
+            jsonp_loop_leave(parents);
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+static int encode_root(const json_t *json, size_t flags, strbuffer_t *out) {
+    parents_t parents;
+    int res;
+
+    if (!(flags & JSON_ENCODE_ANY)) {
+        if (!json_is_array(json) && !json_is_object(json))
+            return -1;
+    }
+
+    if (strbuffer_init(out))
+        return -1;
+
+    jsonp_parents_init(&parents);
+    res = encode(json, &parents, out);
+    jsonp_parents_close(&parents);
+
+    if (res)
+        strbuffer_close(out);
+    return res;
+}
+
+char *json_cbor_dumps(const json_t *json, size_t flags, size_t *length) {
+    strbuffer_t out;
+
+    if (encode_root(json, flags, &out))
+        return NULL;
+
+    if (length)
+        *length = out.length;
+    return strbuffer_steal_value(&out);
+}
+
+size_t json_cbor_dumpb(const json_t *json, char *buffer, size_t size, size_t flags) {
+    strbuffer_t out;
+    size_t length;
+
+    if (encode_root(json, flags, &out))
+        return 0;
+
+    length = out.length;
+    if (length <= size)
+        memcpy(buffer, out.value, length);
+
+    strbuffer_close(&out);
+    return length;
+}
+
+/*** decoding ***/
+
+typedef struct {
+    const unsigned char *start;
+    const unsigned char *pos;
+    const unsigned char *end;
+    size_t flags;
+    size_t depth;
+    json_error_t *error;
+} cbor_in_t;
+
+static void cbor_error(cbor_in_t *in, enum json_error_code code, const char *msg) {
+    jsonp_error_set(in->error, -1, -1, in->pos - in->start, code, "%s", msg);
+}
+
+/* Read a data item head. Returns its major type, or -1 on error. */
+static int read_head(cbor_in_t *in, uint64_t *value, int *indefinite) {
+    int major, info;
+    size_t i, n;
+
+    if (in->pos == in->end) {
+        cbor_error(in, json_error_premature_end_of_input, "premature end of input");
+        return -1;
+    }
+
+    major = *in->pos >> 5;
+    info = *in->pos & 0x1f;
+    *indefinite = 0;
+
+    if (info < 24) {
+        in->pos++;
+        *value = (uint64_t)info;
+        return major;
+    }
+
+    if (info == CBOR_INDEFINITE) {
+        if (major == CBOR_UINT || major == CBOR_NEGINT || major == CBOR_TAG) {
+            cbor_error(in, json_error_invalid_syntax, "invalid indefinite length");
+            return -1;
+        }
+        in->pos++;
+        *indefinite = 1;
+        *value = 0;
+        return major;
+    }
+
+    if (info > 27) {
+        cbor_error(in, json_error_invalid_syntax, "invalid additional information");
+        return -1;
+    }
+
+    n = (size_t)1 << (info - 24);
+    if ((size_t)(in->end - in->pos) <= n) {
+        cbor_error(in, json_error_premature_end_of_input, "premature end of input");
+        return -1;
+    }
+
+    *value = 0;
+    for (i = 1; i <= n; i++)
+        *value = *value << 8 | in->pos[i];
+    in->pos += n + 1;
+
+    return major;
+}
+
+static int at_break(cbor_in_t *in) {
+    if (in->pos < in->end && *in->pos == CBOR_BREAK) {
+        in->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Read the text string whose head has been read. The result is NUL
+   terminated and must be freed. */
+static char *read_text(cbor_in_t *in, uint64_t length, int indefinite, size_t *len) {
+    strbuffer_t chunks;
+    char *text;
+
+    if (!indefinite) {
+        if (length > (uint64_t)(in->end - in->pos)) {
+            cbor_error(in, json_error_premature_end_of_input, "premature end of input");
+            return NULL;
+        }
+
+        text = jsonp_malloc((size_t)length + 1);
+        if (!text) {
+            cbor_error(in, json_error_out_of_memory, "out of memory");
+            return NULL;
+        }
+        memcpy(text, in->pos, (size_t)length);
+        text[length] = '\0';
+        in->pos += length;
+        *len = (size_t)length;
+    } else {
+        if (strbuffer_init(&chunks)) {
+            cbor_error(in, json_error_out_of_memory, "out of memory");
+            return NULL;
+        }
+
+        while (!at_break(in)) {
+            int chunk_indefinite;
+
+            if (read_head(in, &length, &chunk_indefinite) != CBOR_TEXT ||
+                chunk_indefinite) {
+                cbor_error(in, json_error_invalid_syntax, "invalid text string chunk");
+                strbuffer_close(&chunks);
+                return NULL;
+            }
+
+            if (length > (uint64_t)(in->end - in->pos)) {
+                cbor_error(in, json_error_premature_end_of_input,
+                           "premature end of input");
+                strbuffer_close(&chunks);
+                return NULL;
+            }
+
+            if (strbuffer_append_bytes(&chunks, (const char *)in->pos, (size_t)length)) {
+                cbor_error(in, json_error_out_of_memory, "out of memory");
+                strbuffer_close(&chunks);
+                return NULL;
+            }
+            in->pos += length;
+        }
+
+        *len = chunks.length;
+        text = strbuffer_steal_value(&chunks);
+    }
+
+    if (!utf8_check_string(text, *len)) {
+        cbor_error(in, json_error_invalid_utf8, "invalid UTF-8 in text string");
+        jsonp_free(text);
+        return NULL;
+    }
+
+    return text;
+}
+
+static double from_half(unsigned half) {
+    int exponent = (half >> 10) & 0x1f;
+    unsigned mantissa = half & 0x3ff;
+    double value;
+
+    if (exponent == 0)
+        value = ldexp(mantissa, -24);
+    else if (exponent != 31)
+        value = ldexp(mantissa + 1024, exponent - 25);
+    else
+        value = mantissa ? NAN : INFINITY;
+
+    return half & 0x8000 ? -value : value;
+}
+
+static json_t *decode(cbor_in_t *in);
+
+static json_t *decode_array(cbor_in_t *in, uint64_t count, int indefinite) {
+    /* every item takes at least a byte */
+    size_t remaining = (size_t)(in->end - in->pos);
+    json_t *array = json_array_with_capacity(
+        indefinite ? 0 : count < remaining ? (size_t)count : remaining);
+
+    if (!array) {
+        cbor_error(in, json_error_out_of_memory, "out of memory");
+        return NULL;
+    }
+
+    while (indefinite ? !at_break(in) : count-- > 0) {
+        json_t *item = decode(in);
+        if (!item || json_array_append_new(array, item)) {
+            json_decref(array);
+            return NULL;
+        }
+    }
+
+    return array;
+}
+
+static json_t *decode_map(cbor_in_t *in, uint64_t count, int indefinite) {
+    size_t remaining = (size_t)(in->end - in->pos) / 2;
+    json_t *object = json_object_with_capacity(
+        indefinite ? 0 : count < remaining ? (size_t)count : remaining);
+
+    if (!object) {
+        cbor_error(in, json_error_out_of_memory, "out of memory");
+        return NULL;
+    }
+
+    while (indefinite ? !at_break(in) : count-- > 0) {
+        uint64_t length;
+        int key_indefinite, major;
+        char *key;
+        size_t len, hash;
+        json_t *value;
+
+        major = read_head(in, &length, &key_indefinite);
+        if (major != CBOR_TEXT) {
+            if (major != -1)
+                cbor_error(in, json_error_invalid_syntax, "map key is not a text string");
+            goto error;
+        }
+
+        key = read_text(in, length, key_indefinite, &len);
+        if (!key)
+            goto error;
+
+        if (memchr(key, '\0', len)) {
+            jsonp_free(key);
+            cbor_error(in, json_error_null_byte_in_key,
+                       "NUL byte in object key not supported");
+            goto error;
+        }
+
+        hash = jsonp_object_hash(object, key, len);
+        if ((in->flags & JSON_REJECT_DUPLICATES) &&
+            jsonp_object_getn_hashed(object, key, len, hash)) {
+            jsonp_free(key);
+            cbor_error(in, json_error_duplicate_key, "duplicate object key");
+            goto error;
+        }
+
+        value = decode(in);
+        if (!value || jsonp_object_setn_new_hashed(object, key, len, hash, value)) {
+            jsonp_free(key);
+            goto error;
+        }
+        jsonp_free(key);
+    }
+
+    return object;
+
+error:
+    json_decref(object);
+    return NULL;
+}
+
+static json_t *decode_simple(cbor_in_t *in, const unsigned char *head,
+                             uint64_t value) {
+    json_t *json;
+    double real;
+
+    switch (*head & 0x1f) {
+        case CBOR_FALSE:
+            return json_false();
+
+        case CBOR_TRUE:
+            return json_true();
+
+        case CBOR_NULL:
+            return json_null();
+
+        case CBOR_HALF:
+            real = from_half((unsigned)value);
+            break;
+
+        case CBOR_SINGLE: {
+            uint32_t bits = (uint32_t)value;
+            float single;
+
+            memcpy(&single, &bits, 4);
+            real = single;
+            break;
+        }
+
+        case CBOR_DOUBLE:
+            memcpy(&real, &value, 8);
+            break;
+
+        case CBOR_INDEFINITE:
+            in->pos = head;
+            cbor_error(in, json_error_invalid_syntax, "unexpected break");
+            return NULL;
+
+        default:
+            in->pos = head;
+            cbor_error(in, json_error_invalid_syntax, "unsupported simple value");
+            return NULL;
+    }
+
+    if (!isfinite(real)) {
+        in->pos = head;
+        cbor_error(in, json_error_invalid_syntax, "real is not finite");
+        return NULL;
+    }
+
+    json = json_real(real);
+    if (!json)
+        cbor_error(in, json_error_out_of_memory, "out of memory");
+    return json;
+}
+
+static json_t *decode(cbor_in_t *in) {
+    const unsigned char *head = in->pos;
+    uint64_t value;
+    int indefinite;
+    json_t *json;
+
+    if (++in->depth > JSON_PARSER_MAX_DEPTH) {
+        cbor_error(in, json_error_stack_overflow, "maximum parsing depth reached");
+        return NULL;
+    }
+
+    switch (read_head(in, &value, &indefinite)) {
+        case CBOR_UINT:
+            if (value > JSON_INT_MAX) {
+                in->pos = head;
+                cbor_error(in, json_error_numeric_overflow, "too big integer");
+                return NULL;
+            }
+            json = (in->flags & JSON_DECODE_INT_AS_REAL)
+                       ? json_real((double)value)
+                       : json_integer((json_int_t)value);
+            break;
+
+        case CBOR_NEGINT:
+            if (value > JSON_INT_MAX) {
+                in->pos = head;
+                cbor_error(in, json_error_numeric_overflow, "too big negative integer");
+                return NULL;
+            }
+            json = (in->flags & JSON_DECODE_INT_AS_REAL)
+                       ? json_real(-1.0 - (double)value)
+                       : json_integer(-1 - (json_int_t)value);
+            break;
+
+        case CBOR_BYTES:
+            in->pos = head;
+            cbor_error(in, json_error_invalid_syntax, "byte strings are not supported");
+            return NULL;
+
+        case CBOR_TEXT: {
+            size_t len;
+            char *text = read_text(in, value, indefinite, &len);
+
+            if (!text)
+                return NULL;
+
+            if (!(in->flags & JSON_ALLOW_NUL) && memchr(text, '\0', len)) {
+                jsonp_free(text);
+                in->pos = head;
+                cbor_error(in, json_error_null_character,
+                           "\\u0000 is not allowed without JSON_ALLOW_NUL");
+                return NULL;
+            }
+
+            json = jsonp_stringn_nocheck_own(text, len);
+            break;
+        }
+
+        case CBOR_ARRAY:
+            json = decode_array(in, value, indefinite);
+            if (!json)
+                return NULL;
+            break;
+
+        case CBOR_MAP:
+            json = decode_map(in, value, indefinite);
+            if (!json)
+                return NULL;
+            break;
+
+        case CBOR_TAG:
+            /* the tagged item stands for itself */
+            json = decode(in);
+            if (!json)
+                return NULL;
+            break;
+
+        case CBOR_SIMPLE:
+            json = decode_simple(in, head, value);
+            if (!json)
+                return NULL;
+            break;
+
+        default:
+            return NULL;
+    }
+
+    if (!json) {
+        cbor_error(in, json_error_out_of_memory, "out of memory");
+        return NULL;
+    }
+
+    if ((in->flags & JSON_DECODE_CONFINED) && json->refcount != (size_t)-1)
+        json->flags |= JSON_VALUE_CONFINED;
+
+    in->depth--;
+    return json;
+}
+
+json_t *json_cbor_loadb(const char *buffer, size_t buflen, size_t flags,
+                        json_error_t *error) {
+    cbor_in_t in;
+    json_t *result;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if (buffer == NULL) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "wrong arguments");
+        return NULL;
+    }
+
+    in.start = in.pos = (const unsigned char *)buffer;
+    in.end = in.start + buflen;
+    in.flags = flags;
+    in.depth = 0;
+    in.error = error;
+
+    if (!(flags & JSON_DECODE_ANY)) {
+        /* tags aside, the first item must be an array or a map */
+        const unsigned char *p = in.pos;
+
+        while (p < in.end && *p >> 5 == CBOR_TAG) {
+            int info = *p & 0x1f;
+            p += 1 + (info < 24 ? 0 : info <= 27 ? (size_t)1 << (info - 24) : 0);
+        }
+        if (p >= in.end || (*p >> 5 != CBOR_ARRAY && *p >> 5 != CBOR_MAP)) {
+            cbor_error(&in, json_error_invalid_syntax, "array or map expected");
+            return NULL;
+        }
+    }
+
+    result = decode(&in);
+    if (!result)
+        return NULL;
+
+    if (!(flags & JSON_DISABLE_EOF_CHECK) && in.pos != in.end) {
+        cbor_error(&in, json_error_end_of_input_expected, "end of input expected");
+        json_decref(result);
+        return NULL;
+    }
+
+    if (error) {
+        /* Save the position even though there was no error */
+        error->position = (int)(in.pos - in.start);
+    }
+
+    return result;
+}
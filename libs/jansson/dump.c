@@ -12,15 +12,18 @@
 #include "jansson_private.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef JSON_HAVE_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "jansson.h"
-#include "strbuffer.h"
 #include "utf.h"
 
 #define MAX_INTEGER_STR_LENGTH 25
@@ -29,23 +32,95 @@
 #define FLAGS_TO_INDENT(f) ((f) & 0x1F)
 #define FLAGS_TO_PRECISION(f) (((f) >> 11) & 0x1F)
 
-struct buffer {
-  const size_t size;
-  size_t used;
+/* The encoder appends to one contiguous buffer, bounds checked inline.
+   Only when it is full does the slow path run: the buffer is grown,
+   handed to a callback, or (for a caller's fixed buffer) the rest of
+   the output is just counted. */
+#define OUT_GROW 0
+#define OUT_FLUSH 1
+#define OUT_FIXED 2
+
+#define OUT_FLUSH_SIZE 4096
+
+typedef struct {
   char *data;
-};
+  size_t used;
+  size_t size;
+  int mode;
+  size_t overflow; /* OUT_FIXED: bytes that didn't fit */
+  json_dump_callback_t callback; /* OUT_FLUSH */
+  void *callback_data;
+
+  /* JSON_SORT_KEYS: object iterators being sorted, a stack of one
+     slice per object being dumped, reused for the whole call */
+  void **sorted;
+  size_t sorted_used;
+  size_t sorted_size;
+} dump_out_t;
+
+static int out_spill(dump_out_t *out, const char *bytes, size_t size) {
+  switch (out->mode) {
+  case OUT_GROW: {
+    size_t new_size;
+    char *new_data;
+
+    if (size > (size_t)-1 / 2 - out->used)
+      return -1;
+
+    new_size = max(out->size * 2, out->used + size);
+    new_data = jsonp_realloc(out->data, out->size, new_size);
+    if (!new_data)
+      return -1;
+
+    out->data = new_data;
+    out->size = new_size;
+    break;
+  }
 
-static int dump_to_strbuffer(const char *buffer, size_t size, void *data) {
-  return strbuffer_append_bytes((strbuffer_t *)data, buffer, size);
+  case OUT_FLUSH:
+    if (out->used && out->callback(out->data, out->used, out->callback_data))
+      return -1;
+    out->used = 0;
+
+    if (size > out->size)
+      return out->callback(bytes, size, out->callback_data);
+    break;
+
+  default:
+    out->overflow += size;
+    return 0;
+  }
+
+  memcpy(out->data + out->used, bytes, size);
+  out->used += size;
+  return 0;
 }
 
-static int dump_to_buffer(const char *buffer, size_t size, void *data) {
-  struct buffer *buf = (struct buffer *)data;
+static JSON_INLINE int out_write(dump_out_t *out, const char *bytes,
+                                 size_t size) {
+  if (size <= out->size - out->used) {
+    memcpy(out->data + out->used, bytes, size);
+    out->used += size;
+    return 0;
+  }
+  return out_spill(out, bytes, size);
+}
 
-  if (buf->used + size <= buf->size)
-    memcpy(&buf->data[buf->used], buffer, size);
+static JSON_INLINE int out_byte(dump_out_t *out, char byte) {
+  if (out->used < out->size) {
+    out->data[out->used++] = byte;
+    return 0;
+  }
+  return out_spill(out, &byte, 1);
+}
 
-  buf->used += size;
+/* Hand what is left in an OUT_FLUSH buffer to the callback */
+static int out_finish(dump_out_t *out) {
+  if (out->mode == OUT_FLUSH && out->used) {
+    if (out->callback(out->data, out->used, out->callback_data))
+      return -1;
+    out->used = 0;
+  }
   return 0;
 }
 
@@ -72,35 +147,96 @@ static int dump_to_fd(const char *buffer, size_t size, void *data) {
 /* 32 spaces (the maximum indentation size) */
 static const char whitespace[] = "                                ";
 
-static int dump_indent(size_t flags, int depth, int space,
-                       json_dump_callback_t dump, void *data) {
+static int dump_indent(size_t flags, int depth, int space, dump_out_t *out) {
   if (FLAGS_TO_INDENT(flags) > 0) {
     unsigned int ws_count = FLAGS_TO_INDENT(flags), n_spaces = depth * ws_count;
 
-    if (dump("\n", 1, data))
+    if (out_byte(out, '\n'))
       return -1;
 
     while (n_spaces > 0) {
       int cur_n =
           n_spaces < sizeof whitespace - 1 ? n_spaces : sizeof whitespace - 1;
 
-      if (dump(whitespace, cur_n, data))
+      if (out_write(out, whitespace, cur_n))
         return -1;
 
       n_spaces -= cur_n;
     }
   } else if (space && !(flags & JSON_COMPACT)) {
-    return dump(" ", 1, data);
+    return out_byte(out, ' ');
   }
   return 0;
 }
 
-static int dump_string(const char *str, size_t len, json_dump_callback_t dump,
-                       void *data, size_t flags) {
+/* printable ASCII that is copied as is */
+#define is_plain(c, slash)                                                     \
+  ((unsigned char)(c) >= 0x20 && (unsigned char)(c) < 0x80 && (c) != '"' &&  \
+   (c) != '\\' && (c) != (slash))
+
+/* Returns the first byte from p on that is not plain ASCII: a
+   character to escape or the start of a multi-byte sequence. Looks at
+   a block of bytes at a time and only checks the block that has such
+   a byte byte by byte. */
+static const char *scan_plain(const char *p, const char *end, size_t flags) {
+  /* with no slash escaping, compare against '"' twice */
+  char slash = (flags & JSON_ESCAPE_SLASH) ? '/' : '"';
+
+#ifdef JSON_HAVE_SSE2
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i solidus = _mm_set1_epi8(slash);
+
+  while (end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+
+    /* a signed compare catches control characters and bytes >= 0x80 */
+    __m128i special =
+        _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(bytes, space),
+                                  _mm_cmpeq_epi8(bytes, quote)),
+                     _mm_or_si128(_mm_cmpeq_epi8(bytes, backslash),
+                                  _mm_cmpeq_epi8(bytes, solidus)));
+
+    if (_mm_movemask_epi8(special))
+      break;
+    p += 16;
+  }
+#else
+  const uint64_t lsb = 0x0101010101010101ULL, msb = 0x8080808080808080ULL;
+
+  while (end - p >= 8) {
+    uint64_t bytes, special;
+
+    memcpy(&bytes, p, 8);
+
+    /* high bit of each byte below 0x20, equal to one of the special
+       characters, or not ASCII */
+#define has_zero(x) (((x)-lsb) & ~(x)&msb)
+    special = (((bytes - lsb * 0x20) & ~bytes) | bytes) & msb;
+    special |= has_zero(bytes ^ (lsb * '"'));
+    special |= has_zero(bytes ^ (lsb * '\\'));
+    special |= has_zero(bytes ^ (lsb * (unsigned char)slash));
+#undef has_zero
+
+    if (special)
+      break;
+    p += 8;
+  }
+#endif
+
+  while (p < end && is_plain(*p, slash))
+    p++;
+
+  return p;
+}
+
+static int dump_string(const char *str, size_t len, dump_out_t *out,
+                       size_t flags) {
   const char *pos, *end, *lim;
   int32_t codepoint = 0;
 
-  if (dump("\"", 1, data))
+  if (out_byte(out, '\"'))
     return -1;
 
   end = pos = str;
@@ -110,32 +246,38 @@ static int dump_string(const char *str, size_t len, json_dump_callback_t dump,
     char seq[13];
     int length;
 
-    while (end < lim) {
-      end = utf8_iterate(pos, lim - pos, &codepoint);
-      if (!end)
-        return -1;
-
-      /* mandatory escape or control char */
-      if (codepoint == '\\' || codepoint == '"' || codepoint < 0x20)
+    /* find the next character to escape, plain runs are copied in
+       one go below */
+    while (1) {
+      pos = scan_plain(pos, lim, flags);
+      if (pos == lim)
         break;
 
-      /* slash */
-      if ((flags & JSON_ESCAPE_SLASH) && codepoint == '/')
+      if ((unsigned char)*pos < 0x80) {
+        /* \, ", / or a control character */
+        codepoint = (unsigned char)*pos;
+        end = pos + 1;
         break;
+      }
+
+      /* validate multi-byte sequences even when copying them */
+      end = utf8_iterate(pos, lim - pos, &codepoint);
+      if (!end)
+        return -1;
 
       /* non-ASCII */
-      if ((flags & JSON_ENSURE_ASCII) && codepoint > 0x7F)
+      if (flags & JSON_ENSURE_ASCII)
         break;
 
       pos = end;
     }
 
     if (pos != str) {
-      if (dump(str, pos - str, data))
+      if (out_write(out, str, pos - str))
         return -1;
     }
 
-    if (end == pos)
+    if (pos == lim)
       break;
 
     /* handle \, /, ", and control codes */
@@ -190,35 +332,96 @@ static int dump_string(const char *str, size_t len, json_dump_callback_t dump,
     }
     }
 
-    if (dump(text, length, data))
+    if (out_write(out, text, length))
       return -1;
 
     str = pos = end;
   }
 
-  return dump("\"", 1, data);
+  return out_byte(out, '\"');
 }
 
-struct key_len {
-  const char *key;
-  int len;
-};
-
-static int compare_keys(const void *key1, const void *key2) {
-  const struct key_len *k1 = key1;
-  const struct key_len *k2 = key2;
-  const size_t min_size = k1->len < k2->len ? k1->len : k2->len;
-  int res = memcmp(k1->key, k2->key, min_size);
+static int compare_keys(const void *iter1, const void *iter2) {
+  void *i1 = *(void *const *)iter1;
+  void *i2 = *(void *const *)iter2;
+  const size_t len1 = json_object_iter_key_len(i1);
+  const size_t len2 = json_object_iter_key_len(i2);
+  int res = memcmp(json_object_iter_key(i1), json_object_iter_key(i2),
+                   len1 < len2 ? len1 : len2);
 
   if (res)
     return res;
 
-  return k1->len - k2->len;
+  return (len1 > len2) - (len1 < len2);
+}
+
+/* Make room for count more iterators on the sort stack */
+static int sorted_reserve(dump_out_t *out, size_t count) {
+  size_t new_size;
+  void **new_sorted;
+
+  if (count <= out->sorted_size - out->sorted_used)
+    return 0;
+
+  if (count > (size_t)-1 / sizeof(void *) / 2 - out->sorted_used)
+    return -1;
+
+  new_size = max(out->sorted_size * 2, out->sorted_used + count);
+  new_sorted = jsonp_realloc(out->sorted, out->sorted_size * sizeof(void *),
+                             new_size * sizeof(void *));
+  if (!new_sorted)
+    return -1;
+
+  out->sorted = new_sorted;
+  out->sorted_size = new_size;
+  return 0;
+}
+
+static int dump_integer(json_int_t value, dump_out_t *out) {
+  char buffer[MAX_INTEGER_STR_LENGTH];
+  int size;
+
+  size = snprintf(buffer, MAX_INTEGER_STR_LENGTH, "%" JSON_INTEGER_FORMAT,
+                  value);
+  if (size < 0 || size >= MAX_INTEGER_STR_LENGTH)
+    return -1;
+
+  return out_write(out, buffer, size);
+}
+
+static int dump_real(double value, size_t flags, dump_out_t *out) {
+  char buffer[MAX_REAL_STR_LENGTH];
+  int size;
+
+  size = jsonp_dtostr(buffer, MAX_REAL_STR_LENGTH, value,
+                      FLAGS_TO_PRECISION(flags));
+  if (size < 0)
+    return -1;
+
+  return out_write(out, buffer, size);
 }
 
 static int do_dump(const json_t *json, size_t flags, int depth,
-                   hashtable_t *parents, json_dump_callback_t dump,
-                   void *data) {
+                   parents_t *parents, dump_out_t *out);
+
+static int dump_array_item(const json_t *json, size_t index, size_t flags,
+                           int depth, parents_t *parents, dump_out_t *out) {
+  json_int_t integer;
+  double real;
+
+  /* don't create json_t values for packed arrays */
+  switch (jsonp_array_packed_value(json, index, &integer, &real)) {
+  case ARRAY_PACKED_INTEGER:
+    return dump_integer(integer, out);
+  case ARRAY_PACKED_REAL:
+    return dump_real(real, flags, out);
+  default:
+    return do_dump(json_array_get(json, index), flags, depth, parents, out);
+  }
+}
+
+static int do_dump(const json_t *json, size_t flags, int depth,
+                   parents_t *parents, dump_out_t *out) {
   int embed = flags & JSON_EMBED;
 
   flags &= ~JSON_EMBED;
@@ -228,90 +431,64 @@ static int do_dump(const json_t *json, size_t flags, int depth,
 
   switch (json_typeof(json)) {
   case JSON_NULL:
-    return dump("null", 4, data);
+    return out_write(out, "null", 4);
 
   case JSON_TRUE:
-    return dump("true", 4, data);
+    return out_write(out, "true", 4);
 
   case JSON_FALSE:
-    return dump("false", 5, data);
-
-  case JSON_INTEGER: {
-    char buffer[MAX_INTEGER_STR_LENGTH];
-    int size;
-
-    size = snprintf(buffer, MAX_INTEGER_STR_LENGTH, "%" JSON_INTEGER_FORMAT,
-                    json_integer_value(json));
-    if (size < 0 || size >= MAX_INTEGER_STR_LENGTH)
-      return -1;
+    return out_write(out, "false", 5);
 
-    return dump(buffer, size, data);
-  }
-
-  case JSON_REAL: {
-    char buffer[MAX_REAL_STR_LENGTH];
-    int size;
-    double value = json_real_value(json);
+  case JSON_INTEGER:
+    return dump_integer(json_integer_value(json), out);
 
-    size = jsonp_dtostr(buffer, MAX_REAL_STR_LENGTH, value,
-                        FLAGS_TO_PRECISION(flags));
-    if (size < 0)
-      return -1;
-
-    return dump(buffer, size, data);
-  }
+  case JSON_REAL:
+    return dump_real(json_real_value(json), flags, out);
 
   case JSON_STRING:
-    return dump_string(json_string_value(json), json_string_length(json), dump,
-                       data, flags);
+    return dump_string(json_string_value(json), json_string_length(json), out,
+                       flags);
 
   case JSON_ARRAY: {
     size_t n;
     size_t i;
-    /* Space for "0x", double the sizeof a pointer for the hex and a
-     * terminator. */
-    char key[2 + (sizeof(json) * 2) + 1];
-    size_t key_len;
 
     /* detect circular references */
-    if (jsonp_loop_check(parents, json, key, sizeof(key), &key_len))
+    if (jsonp_loop_check(parents, json))
       return -1;
 
     n = json_array_size(json);
 
-    if (!embed && dump("[", 1, data))
+    if (!embed && out_byte(out, '['))
       return -1;
     if (n == 0) {
-      hashtable_del(parents, key, key_len);
-      return embed ? 0 : dump("]", 1, data);
+      jsonp_loop_leave(parents);
+      return embed ? 0 : out_byte(out, ']');
     }
-    if (dump_indent(flags, depth + 1, 0, dump, data))
+    if (dump_indent(flags, depth + 1, 0, out))
       return -1;
 
     for (i = 0; i < n - 1; ++i) {
-      if (do_dump(json_array_get(json, i), flags, depth + 1, parents, dump,
-                  data))
+      if (dump_array_item(json, i, flags, depth + 1, parents, out))
         return -1;
 
-      if (dump(",", 1, data) || dump_indent(flags, depth + 1, 1, dump, data))
+      if (out_byte(out, ',') || dump_indent(flags, depth + 1, 1, out))
         return -1;
     }
 
-    if (do_dump(json_array_get(json, i), flags, depth + 1, parents, dump, data))
+    if (dump_array_item(json, i, flags, depth + 1, parents, out))
       return -1;
-    if (dump_indent(flags, depth, 0, dump, data))
+    if (dump_indent(flags, depth, 0, out))
       return -1;
 
-    hashtable_del(parents, key, key_len);
-    return embed ? 0 : dump("]", 1, data);
+    jsonp_loop_leave(parents);
+    return embed ? 0 : out_byte(out, ']');
   }
 
   case JSON_OBJECT: {
     void *iter;
     const char *separator;
     int separator_length;
-    char loop_key[LOOP_KEY_LEN];
-    size_t loop_key_len;
 
     if (flags & JSON_COMPACT) {
       separator = ":";
@@ -322,74 +499,62 @@ static int do_dump(const json_t *json, size_t flags, int depth,
     }
 
     /* detect circular references */
-    if (jsonp_loop_check(parents, json, loop_key, sizeof(loop_key),
-                         &loop_key_len))
+    if (jsonp_loop_check(parents, json))
       return -1;
 
-    if (!embed && dump("{", 1, data))
+    if (!embed && out_byte(out, '{'))
       return -1;
 
     iter = json_object_iter((json_t *)json);
     if (!iter) {
-      hashtable_del(parents, loop_key, loop_key_len);
-      return embed ? 0 : dump("}", 1, data);
+      jsonp_loop_leave(parents);
+      return embed ? 0 : out_byte(out, '}');
     }
-    if (dump_indent(flags, depth + 1, 0, dump, data))
+    if (dump_indent(flags, depth + 1, 0, out))
       return -1;
 
     if (flags & JSON_SORT_KEYS) {
-      struct key_len *keys;
-      size_t size, i;
+      size_t size, base, i;
+      void **iters;
 
+      /* Sort the iterators themselves, so that each value is read
+         straight from its pair instead of being looked up again */
       size = json_object_size(json);
-      keys = jsonp_malloc(size * sizeof(struct key_len));
-      if (!keys)
+      if (sorted_reserve(out, size))
         return -1;
 
-      i = 0;
-      while (iter) {
-        struct key_len *keylen = &keys[i];
-
-        keylen->key = json_object_iter_key(iter);
-        keylen->len = json_object_iter_key_len(iter);
-
+      base = out->sorted_used;
+      iters = out->sorted + base;
+      for (i = 0; iter; i++) {
+        iters[i] = iter;
         iter = json_object_iter_next((json_t *)json, iter);
-        i++;
       }
       assert(i == size);
 
-      qsort(keys, size, sizeof(struct key_len), compare_keys);
+      qsort(iters, size, sizeof(void *), compare_keys);
+      out->sorted_used += size;
 
       for (i = 0; i < size; i++) {
-        const struct key_len *key;
-        json_t *value;
-
-        key = &keys[i];
-        value = json_object_getn(json, key->key, key->len);
-        assert(value);
-
-        dump_string(key->key, key->len, dump, data, flags);
-        if (dump(separator, separator_length, data) ||
-            do_dump(value, flags, depth + 1, parents, dump, data)) {
-          jsonp_free(keys);
+        /* nested objects may have moved the stack */
+        void *it = out->sorted[base + i];
+
+        if (dump_string(json_object_iter_key(it), json_object_iter_key_len(it),
+                        out, flags) ||
+            out_write(out, separator, separator_length) ||
+            do_dump(json_object_iter_value(it), flags, depth + 1, parents,
+                    out))
           return -1;
-        }
 
         if (i < size - 1) {
-          if (dump(",", 1, data) ||
-              dump_indent(flags, depth + 1, 1, dump, data)) {
-            jsonp_free(keys);
+          if (out_byte(out, ',') || dump_indent(flags, depth + 1, 1, out))
             return -1;
-          }
         } else {
-          if (dump_indent(flags, depth, 0, dump, data)) {
-            jsonp_free(keys);
+          if (dump_indent(flags, depth, 0, out))
             return -1;
-          }
         }
       }
 
-      jsonp_free(keys);
+      out->sorted_used = base;
     } else {
       /* Don't sort keys */
 
@@ -398,18 +563,17 @@ static int do_dump(const json_t *json, size_t flags, int depth,
         const char *key = json_object_iter_key(iter);
         const size_t key_len = json_object_iter_key_len(iter);
 
-        dump_string(key, key_len, dump, data, flags);
-        if (dump(separator, separator_length, data) ||
+        dump_string(key, key_len, out, flags);
+        if (out_write(out, separator, separator_length) ||
             do_dump(json_object_iter_value(iter), flags, depth + 1, parents,
-                    dump, data))
+                    out))
           return -1;
 
         if (next) {
-          if (dump(",", 1, data) ||
-              dump_indent(flags, depth + 1, 1, dump, data))
+          if (out_byte(out, ',') || dump_indent(flags, depth + 1, 1, out))
             return -1;
         } else {
-          if (dump_indent(flags, depth, 0, dump, data))
+          if (dump_indent(flags, depth, 0, out))
             return -1;
         }
 
@@ -417,8 +581,8 @@ static int do_dump(const json_t *json, size_t flags, int depth,
       }
     }
 
-    hashtable_del(parents, loop_key, loop_key_len);
-    return embed ? 0 : dump("}", 1, data);
+    jsonp_loop_leave(parents);
+    return embed ? 0 : out_byte(out, '}');
   }
 
   default:
@@ -427,36 +591,133 @@ static int do_dump(const json_t *json, size_t flags, int depth,
   }
 }
 
+/* Rough size of the encoding of json, so that json_dumpsn() can
+   allocate its buffer once in the common case. Gives up after
+   ESTIMATE_BUDGET values or below ESTIMATE_DEPTH, which also bounds
+   the walk for circular references; the buffer grows past the
+   estimate anyway. */
+#define ESTIMATE_BUDGET 65536
+#define ESTIMATE_DEPTH 32
+
+static size_t dump_estimate(const json_t *json, size_t flags, int depth,
+                            size_t *budget) {
+  /* newline and indentation, or ", ", before each member */
+  size_t member = FLAGS_TO_INDENT(flags)
+                      ? 1 + FLAGS_TO_INDENT(flags) * (size_t)(depth + 1)
+                      : 2;
+  size_t size, n, i;
+
+  if (!json || !*budget || depth > ESTIMATE_DEPTH)
+    return 0;
+  (*budget)--;
+
+  switch (json_typeof(json)) {
+  case JSON_STRING:
+    return json_string_length(json) + 2;
+
+  case JSON_INTEGER:
+    return 8;
+
+  case JSON_REAL:
+    return 12;
+
+  case JSON_ARRAY:
+    n = json_array_size(json);
+    size = 2 + n * member;
+    for (i = 0; i < n; i++) {
+      json_int_t integer;
+      double real;
+
+      if (jsonp_array_packed_value(json, i, &integer, &real) != ARRAY_UNPACKED)
+        size += 12;
+      else
+        size += dump_estimate(json_array_get(json, i), flags, depth + 1,
+                              budget);
+
+      if (!*budget)
+        break;
+    }
+    return size;
+
+  case JSON_OBJECT: {
+    void *iter = json_object_iter((json_t *)json);
+
+    size = 2;
+    while (iter && *budget) {
+      size += member + json_object_iter_key_len(iter) + 4 +
+              dump_estimate(json_object_iter_value(iter), flags, depth + 1,
+                            budget);
+      iter = json_object_iter_next((json_t *)json, iter);
+    }
+    return size;
+  }
+
+  default:
+    return 5;
+  }
+}
+
+static int dump_json(const json_t *json, size_t flags, dump_out_t *out) {
+  int res;
+  parents_t parents;
+
+  if (!(flags & JSON_ENCODE_ANY)) {
+    if (!json_is_array(json) && !json_is_object(json))
+      return -1;
+  }
+
+  jsonp_parents_init(&parents);
+  res = do_dump(json, flags, 0, &parents, out);
+  jsonp_parents_close(&parents);
+  jsonp_free(out->sorted);
+
+  return res;
+}
+
 char *json_dumps(const json_t *json, size_t flags) {
-  strbuffer_t strbuff;
-  char *result;
+  return json_dumpsn(json, flags, NULL);
+}
+
+char *json_dumpsn(const json_t *json, size_t flags, size_t *length) {
+  dump_out_t out;
+  size_t budget = ESTIMATE_BUDGET;
 
-  if (strbuffer_init(&strbuff))
+  memset(&out, 0, sizeof(out));
+  out.mode = OUT_GROW;
+  out.size = dump_estimate(json, flags, 0, &budget) + 1;
+  out.data = jsonp_malloc(out.size);
+  if (!out.data)
     return NULL;
 
-  if (json_dump_callback(json, dump_to_strbuffer, (void *)&strbuff, flags))
-    result = NULL;
-  else {
-    char *new_result;
-    result = strbuffer_steal_value(&strbuff);
-    // technically the resizing is not needed.
-    new_result = jsonp_realloc(result, strbuff.size, strbuff.length + 1);
-    if (new_result) { // when realloc fails we just use the original pointer
-      result = new_result;
-    }
+  if (dump_json(json, flags, &out) || out_byte(&out, '\0')) {
+    jsonp_free(out.data);
+    return NULL;
   }
 
-  strbuffer_close(&strbuff);
-  return result;
+  if (out.used < out.size / 2) {
+    /* give back a bad overestimate, keep the buffer if that fails */
+    char *data = jsonp_realloc(out.data, out.size, out.used);
+    if (data)
+      out.data = data;
+  }
+
+  if (length)
+    *length = out.used - 1;
+  return out.data;
 }
 
 size_t json_dumpb(const json_t *json, char *buffer, size_t size, size_t flags) {
-  struct buffer buf = {size, 0, buffer};
+  dump_out_t out;
 
-  if (json_dump_callback(json, dump_to_buffer, (void *)&buf, flags))
+  memset(&out, 0, sizeof(out));
+  out.mode = OUT_FIXED;
+  out.data = buffer;
+  out.size = buffer ? size : 0;
+
+  if (dump_json(json, flags, &out))
     return 0;
 
-  return buf.used;
+  return out.used + out.overflow;
 }
 
 int json_dumpf(const json_t *json, FILE *output, size_t flags) {
@@ -484,18 +745,625 @@ int json_dump_file(const json_t *json, const char *path, size_t flags) {
 
 int json_dump_callback(const json_t *json, json_dump_callback_t callback,
                        void *data, size_t flags) {
-  int res;
-  hashtable_t parents_set;
+  char buffer[OUT_FLUSH_SIZE];
+  dump_out_t out;
+
+  memset(&out, 0, sizeof(out));
+  out.mode = OUT_FLUSH;
+  out.data = buffer;
+  out.size = sizeof(buffer);
+  out.callback = callback;
+  out.callback_data = data;
+
+  if (dump_json(json, flags, &out))
+    return -1;
+
+  return out_finish(&out);
+}
+
+/* Resumable encoder. Walks the value with an explicit stack of the
+   containers being written instead of recursing, so it can stop at any
+   point and continue later. Output is produced a token at a time into
+   a staging buffer and handed out from there; only a single string
+   longer than the chunk size makes that buffer grow. */
+
+#define DUMPER_CHUNK OUT_FLUSH_SIZE
+/* hex chunk size and CRLF before the data, CRLF after it */
+#define DUMPER_HEAD 10
+#define DUMPER_TAIL 2
+
+#define DUMPER_START 0
+#define DUMPER_RUNNING 1
+#define DUMPER_DONE 2
+#define DUMPER_ERROR 3
+
+typedef struct {
+  const json_t *json;
+  size_t index; /* next member */
+  size_t size;
+  void *iter; /* objects without JSON_SORT_KEYS */
+  size_t sorted; /* start of the slice in out.sorted */
+} dump_frame_t;
+
+struct json_dumper {
+  json_t *json;
+  size_t flags;
+  int embed;
+  int state;
+  dump_out_t out;
+  size_t taken; /* bytes of out.data already handed out */
+
+  dump_frame_t *frames;
+  size_t depth;
+  size_t frames_size;
+
+  /* json_dumper_write_chunked(): chunk not yet accepted by write() */
+  char chunk[DUMPER_HEAD + DUMPER_CHUNK + DUMPER_TAIL];
+  size_t chunk_pos;
+  size_t chunk_end;
+  int last_chunk;
+};
+
+/* Write a scalar, or open a container and push its frame */
+static int dumper_value(json_dumper_t *dumper, const json_t *json) {
+  dump_out_t *out = &dumper->out;
+  size_t flags = dumper->flags;
+  int depth = (int)dumper->depth;
+  int embed = dumper->embed && depth == 0;
+  dump_frame_t *frame;
+  size_t i;
+
+  switch (json_typeof(json)) {
+  case JSON_OBJECT:
+  case JSON_ARRAY:
+    break;
+  default:
+    return do_dump(json, flags, depth, NULL, out);
+  }
+
+  /* detect circular references */
+  for (i = 0; i < dumper->depth; i++) {
+    if (dumper->frames[i].json == json)
+      return -1;
+  }
+
+  if (!embed && out_byte(out, json_is_object(json) ? '{' : '['))
+    return -1;
+
+  if (dumper->depth == dumper->frames_size) {
+    size_t new_size = dumper->frames_size ? dumper->frames_size * 2 : 16;
+    dump_frame_t *new_frames;
+
+    new_frames = jsonp_realloc(dumper->frames,
+                               dumper->frames_size * sizeof(dump_frame_t),
+                               new_size * sizeof(dump_frame_t));
+    if (!new_frames)
+      return -1;
+
+    dumper->frames = new_frames;
+    dumper->frames_size = new_size;
+  }
+
+  frame = &dumper->frames[dumper->depth];
+  frame->json = json;
+  frame->index = 0;
+  frame->iter = NULL;
+  frame->sorted = out->sorted_used;
+
+  if (json_is_array(json)) {
+    frame->size = json_array_size(json);
+  } else {
+    frame->size = json_object_size(json);
+    frame->iter = json_object_iter((json_t *)json);
+
+    if ((flags & JSON_SORT_KEYS) && frame->size) {
+      void **iters;
+
+      if (sorted_reserve(out, frame->size))
+        return -1;
+
+      iters = out->sorted + frame->sorted;
+      for (i = 0; frame->iter; i++) {
+        iters[i] = frame->iter;
+        frame->iter = json_object_iter_next((json_t *)json, frame->iter);
+      }
+      qsort(iters, frame->size, sizeof(void *), compare_keys);
+      out->sorted_used += frame->size;
+    }
+  }
+
+  if (frame->size == 0)
+    return embed ? 0 : out_byte(out, json_is_object(json) ? '}' : ']');
+
+  dumper->depth++;
+  return dump_indent(flags, depth + 1, 0, out);
+}
+
+/* Write the next member of the innermost container, or close it */
+static int dumper_step(json_dumper_t *dumper) {
+  dump_out_t *out = &dumper->out;
+  size_t flags = dumper->flags;
+  dump_frame_t *frame = &dumper->frames[dumper->depth - 1];
+  int depth = (int)dumper->depth - 1;
+  const json_t *json = frame->json;
+
+  if (frame->index == frame->size) {
+    dumper->depth--;
+    out->sorted_used = frame->sorted;
+
+    if (dump_indent(flags, depth, 0, out))
+      return -1;
+    if (dumper->embed && depth == 0)
+      return 0;
+    return out_byte(out, json_is_object(json) ? '}' : ']');
+  }
+
+  if (frame->index > 0) {
+    if (out_byte(out, ',') || dump_indent(flags, depth + 1, 1, out))
+      return -1;
+  }
+
+  if (json_is_array(json)) {
+    json_int_t integer;
+    double real;
+
+    switch (jsonp_array_packed_value(json, frame->index++, &integer, &real)) {
+    case ARRAY_PACKED_INTEGER:
+      return dump_integer(integer, out);
+    case ARRAY_PACKED_REAL:
+      return dump_real(real, flags, out);
+    default:
+      json = json_array_get(json, frame->index - 1);
+      break;
+    }
+  } else {
+    void *iter;
+
+    if (flags & JSON_SORT_KEYS) {
+      iter = out->sorted[frame->sorted + frame->index];
+    } else {
+      iter = frame->iter;
+      if (!iter)
+        return -1;
+      frame->iter = json_object_iter_next((json_t *)json, iter);
+    }
+    frame->index++;
+
+    if (dump_string(json_object_iter_key(iter), json_object_iter_key_len(iter),
+                    out, flags) ||
+        out_write(out, (flags & JSON_COMPACT) ? ":" : ": ",
+                  (flags & JSON_COMPACT) ? 1 : 2))
+      return -1;
+
+    json = json_object_iter_value(iter);
+  }
+
+  if (!json)
+    return -1;
+
+  /* the frame pointer is stale once a container is pushed */
+  return dumper_value(dumper, json);
+}
+
+json_dumper_t *json_dumper_new(json_t *json, size_t flags) {
+  json_dumper_t *dumper;
+
+  if (!json)
+    return NULL;
 
   if (!(flags & JSON_ENCODE_ANY)) {
     if (!json_is_array(json) && !json_is_object(json))
+      return NULL;
+  }
+
+  dumper = jsonp_malloc(sizeof(json_dumper_t));
+  if (!dumper)
+    return NULL;
+  memset(dumper, 0, sizeof(json_dumper_t));
+
+  dumper->out.mode = OUT_GROW;
+  dumper->out.size = DUMPER_CHUNK;
+  dumper->out.data = jsonp_malloc(dumper->out.size);
+  if (!dumper->out.data) {
+    jsonp_free(dumper);
+    return NULL;
+  }
+
+  dumper->json = json_incref(json);
+  dumper->embed = (flags & JSON_EMBED) != 0;
+  dumper->flags = flags & ~JSON_EMBED;
+  dumper->state = DUMPER_START;
+  return dumper;
+}
+
+size_t json_dumper_read(json_dumper_t *dumper, char *buffer, size_t size) {
+  dump_out_t *out;
+  size_t length;
+
+  if (!dumper || !buffer || dumper->state == DUMPER_ERROR)
+    return (size_t)-1;
+
+  out = &dumper->out;
+
+  /* fill the staging buffer until it holds size bytes or the value
+     is done */
+  while (out->used - dumper->taken < size && dumper->state != DUMPER_DONE) {
+    int res;
+
+    if (dumper->state == DUMPER_START) {
+      dumper->state = DUMPER_RUNNING;
+      res = dumper_value(dumper, dumper->json);
+    } else if (dumper->depth) {
+      res = dumper_step(dumper);
+    } else {
+      dumper->state = DUMPER_DONE;
+      break;
+    }
+
+    if (res) {
+      dumper->state = DUMPER_ERROR;
+      return (size_t)-1;
+    }
+
+    if (!dumper->depth)
+      dumper->state = DUMPER_DONE;
+  }
+
+  length = out->used - dumper->taken;
+  if (length > size)
+    length = size;
+
+  memcpy(buffer, out->data + dumper->taken, length);
+  dumper->taken += length;
+
+  if (dumper->taken == out->used) {
+    out->used = dumper->taken = 0;
+  } else if (dumper->taken >= DUMPER_CHUNK) {
+    /* keep the unread tail at the start */
+    memmove(out->data, out->data + dumper->taken, out->used - dumper->taken);
+    out->used -= dumper->taken;
+    dumper->taken = 0;
+  }
+
+  return length;
+}
+
+int json_dumper_write_chunked(json_dumper_t *dumper, int fd) {
+#ifdef HAVE_UNISTD_H
+  if (!dumper)
+    return -1;
+
+  while (1) {
+    size_t length;
+    char head[DUMPER_HEAD + 1];
+    int head_len;
+
+    /* resume a chunk a previous call couldn't finish */
+    while (dumper->chunk_pos < dumper->chunk_end) {
+      ssize_t written = write(fd, dumper->chunk + dumper->chunk_pos,
+                              dumper->chunk_end - dumper->chunk_pos);
+      if (written < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          return 1;
+        return -1;
+      }
+      dumper->chunk_pos += written;
+    }
+
+    if (dumper->last_chunk)
+      return 0;
+
+    length = json_dumper_read(dumper, dumper->chunk + DUMPER_HEAD,
+                              DUMPER_CHUNK);
+    if (length == (size_t)-1)
+      return -1;
+
+    if (length == 0) {
+      /* terminating chunk, no trailers */
+      memcpy(dumper->chunk, "0\r\n\r\n", 5);
+      dumper->chunk_pos = 0;
+      dumper->chunk_end = 5;
+      dumper->last_chunk = 1;
+      continue;
+    }
+
+    /* put the size line right before the data */
+    head_len =
+        snprintf(head, sizeof(head), "%lx\r\n", (unsigned long)length);
+    if (head_len < 0 || head_len > DUMPER_HEAD)
       return -1;
+
+    dumper->chunk_pos = DUMPER_HEAD - head_len;
+    memcpy(dumper->chunk + dumper->chunk_pos, head, head_len);
+    memcpy(dumper->chunk + DUMPER_HEAD + length, "\r\n", DUMPER_TAIL);
+    dumper->chunk_end = DUMPER_HEAD + length + DUMPER_TAIL;
   }
+#else
+  (void)dumper;
+  (void)fd;
+  return -1;
+#endif
+}
+
+void json_dumper_free(json_dumper_t *dumper) {
+  if (!dumper)
+    return;
 
-  if (hashtable_init(&parents_set))
+  json_decref(dumper->json);
+  jsonp_free(dumper->out.data);
+  jsonp_free(dumper->out.sorted);
+  jsonp_free(dumper->frames);
+  jsonp_free(dumper);
+}
+
+/* Compiled templates. All the output that doesn't depend on the data
+   (brackets, keys, separators and indentation) is formatted once, at
+   compile time, into one text. What is left are slots: the struct
+   member to write and how many bytes of text come before it. */
+
+typedef struct {
+  size_t text_len; /* literal bytes before the slot */
+  size_t offset;
+  char type; /* format character, 0 for the end */
+  char nullable;
+} template_slot_t;
+
+typedef struct {
+  char close;
+  size_t count;
+} template_level_t;
+
+struct json_template {
+  size_t flags;
+  dump_out_t text;
+  size_t text_done; /* end of the text already assigned to a slot */
+  template_slot_t *slots;
+  size_t slots_len;
+  size_t slots_size;
+
+  /* while compiling */
+  template_level_t *levels;
+  size_t depth;
+  size_t levels_size;
+};
+
+json_template_t *jsonp_template_new(size_t flags) {
+  json_template_t *tpl = jsonp_malloc(sizeof(json_template_t));
+
+  if (!tpl)
+    return NULL;
+  memset(tpl, 0, sizeof(json_template_t));
+
+  tpl->flags = flags & ~(JSON_EMBED | JSON_SORT_KEYS);
+  tpl->text.mode = OUT_GROW;
+  return tpl;
+}
+
+/* Comma and indentation before a member of the current container */
+static int template_member(json_template_t *tpl) {
+  template_level_t *level;
+  int depth = (int)tpl->depth;
+
+  if (!depth)
+    return 0;
+
+  level = &tpl->levels[depth - 1];
+  if (level->count++ && out_byte(&tpl->text, ','))
     return -1;
-  res = do_dump(json, flags, 0, &parents_set, callback, data);
-  hashtable_close(&parents_set);
 
-  return res;
+  return dump_indent(tpl->flags, depth, level->count > 1, &tpl->text);
+}
+
+int jsonp_template_open(json_template_t *tpl, char bracket) {
+  template_level_t *level;
+
+  /* object values are preceded by their key */
+  if ((!tpl->depth || tpl->levels[tpl->depth - 1].close == ']') &&
+      template_member(tpl))
+    return -1;
+
+  if (tpl->depth == tpl->levels_size) {
+    size_t new_size = tpl->levels_size ? tpl->levels_size * 2 : 8;
+    template_level_t *new_levels;
+
+    new_levels = jsonp_realloc(tpl->levels,
+                               tpl->levels_size * sizeof(template_level_t),
+                               new_size * sizeof(template_level_t));
+    if (!new_levels)
+      return -1;
+
+    tpl->levels = new_levels;
+    tpl->levels_size = new_size;
+  }
+
+  level = &tpl->levels[tpl->depth++];
+  level->close = bracket == '{' ? '}' : ']';
+  level->count = 0;
+
+  return out_byte(&tpl->text, bracket);
+}
+
+int jsonp_template_key(json_template_t *tpl, const char *key, size_t len) {
+  if (template_member(tpl) || dump_string(key, len, &tpl->text, tpl->flags))
+    return -1;
+
+  if (tpl->flags & JSON_COMPACT)
+    return out_byte(&tpl->text, ':');
+  return out_write(&tpl->text, ": ", 2);
+}
+
+int jsonp_template_slot(json_template_t *tpl, char type, size_t offset,
+                        int nullable) {
+  template_slot_t *slot;
+
+  if ((!tpl->depth || tpl->levels[tpl->depth - 1].close == ']') &&
+      template_member(tpl))
+    return -1;
+
+  if (type == 'n')
+    return out_write(&tpl->text, "null", 4);
+
+  if (tpl->slots_len == tpl->slots_size) {
+    size_t new_size = tpl->slots_size ? tpl->slots_size * 2 : 8;
+    template_slot_t *new_slots;
+
+    new_slots = jsonp_realloc(tpl->slots,
+                              tpl->slots_size * sizeof(template_slot_t),
+                              new_size * sizeof(template_slot_t));
+    if (!new_slots)
+      return -1;
+
+    tpl->slots = new_slots;
+    tpl->slots_size = new_size;
+  }
+
+  slot = &tpl->slots[tpl->slots_len++];
+  slot->text_len = tpl->text.used - tpl->text_done;
+  slot->offset = offset;
+  slot->type = type;
+  slot->nullable = (char)nullable;
+  tpl->text_done = tpl->text.used;
+
+  return 0;
+}
+
+int jsonp_template_close(json_template_t *tpl) {
+  template_level_t *level = &tpl->levels[--tpl->depth];
+
+  if (level->count && dump_indent(tpl->flags, (int)tpl->depth, 0, &tpl->text))
+    return -1;
+  return out_byte(&tpl->text, level->close);
+}
+
+int jsonp_template_end(json_template_t *tpl) {
+  /* the text after the last slot */
+  if (jsonp_template_slot(tpl, 0, 0, 0))
+    return -1;
+
+  jsonp_free(tpl->levels);
+  tpl->levels = NULL;
+  tpl->levels_size = 0;
+  return 0;
+}
+
+static int template_render(const json_template_t *tpl, const char *data,
+                           dump_out_t *out) {
+  const char *text = tpl->text.data;
+  size_t i;
+
+  for (i = 0; i < tpl->slots_len; i++) {
+    const template_slot_t *slot = &tpl->slots[i];
+    const char *member = data + slot->offset;
+    int res;
+
+    if (slot->text_len && out_write(out, text, slot->text_len))
+      return -1;
+    text += slot->text_len;
+
+    switch (slot->type) {
+    case 's': {
+      const char *str;
+
+      memcpy(&str, member, sizeof(str));
+      if (!str)
+        res = slot->nullable ? out_write(out, "null", 4) : -1;
+      else
+        res = dump_string(str, strlen(str), out, tpl->flags);
+      break;
+    }
+    case 'i': {
+      int value;
+
+      memcpy(&value, member, sizeof(value));
+      res = dump_integer(value, out);
+      break;
+    }
+    case 'I': {
+      json_int_t value;
+
+      memcpy(&value, member, sizeof(value));
+      res = dump_integer(value, out);
+      break;
+    }
+    case 'f': {
+      double value;
+
+      memcpy(&value, member, sizeof(value));
+      /* NaN and infinity are rejected, as by json_real() */
+      if (value - value != 0.0)
+        return -1;
+      res = dump_real(value, tpl->flags, out);
+      break;
+    }
+    case 'b': {
+      int value;
+
+      memcpy(&value, member, sizeof(value));
+      res = value ? out_write(out, "true", 4) : out_write(out, "false", 5);
+      break;
+    }
+    default:
+      res = 0;
+      break;
+    }
+
+    if (res)
+      return -1;
+  }
+
+  return 0;
+}
+
+char *json_template_dumps(const json_template_t *tpl, const void *data,
+                          size_t *length) {
+  dump_out_t out;
+
+  if (!tpl || !data)
+    return NULL;
+
+  memset(&out, 0, sizeof(out));
+  out.mode = OUT_GROW;
+  out.size = tpl->text.used + tpl->slots_len * 16 + 1;
+  out.data = jsonp_malloc(out.size);
+  if (!out.data)
+    return NULL;
+
+  if (template_render(tpl, data, &out) || out_byte(&out, '\0')) {
+    jsonp_free(out.data);
+    return NULL;
+  }
+
+  if (length)
+    *length = out.used - 1;
+  return out.data;
+}
+
+size_t json_template_dumpb(const json_template_t *tpl, const void *data,
+                           char *buffer, size_t size) {
+  dump_out_t out;
+
+  if (!tpl || !data)
+    return 0;
+
+  memset(&out, 0, sizeof(out));
+  out.mode = OUT_FIXED;
+  out.data = buffer;
+  out.size = buffer ? size : 0;
+
+  if (template_render(tpl, data, &out))
+    return 0;
+
+  return out.used + out.overflow;
+}
+
+void json_template_free(json_template_t *tpl) {
+  if (!tpl)
+    return;
+
+  jsonp_free(tpl->text.data);
+  jsonp_free(tpl->slots);
+  jsonp_free(tpl->levels);
+  jsonp_free(tpl);
 }
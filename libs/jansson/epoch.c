@@ -0,0 +1,212 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Epoch-based reclamation of frozen trees. A reader announces the
+   epoch it started in with json_epoch_enter() and withdraws it with
+   json_epoch_leave(). A tree passed to json_retire() is stamped with
+   the current epoch, which is then advanced; it is freed once every
+   active reader started in a later epoch, as those can't have seen
+   it. Readers only ever write their own record. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jansson.h"
+#include "jansson_private.h"
+
+#if !defined(_WIN32) && JSON_HAVE_ATOMIC_BUILTINS
+
+#include <pthread.h>
+
+/* One per thread, reused after the thread exits. Never freed, so the
+   list can be walked without a lock. */
+typedef struct epoch_record {
+    struct epoch_record *next;
+    size_t epoch; /* 0 when not reading */
+    int in_use;
+} epoch_record_t;
+
+typedef struct epoch_retired {
+    struct epoch_retired *next;
+    json_t *json;
+    size_t epoch;
+} epoch_retired_t;
+
+/* only the owning thread touches these */
+typedef struct {
+    epoch_record_t *record;
+    size_t nesting;
+} epoch_thread_t;
+
+static JSON_THREAD_LOCAL epoch_thread_t thread_epoch;
+
+static size_t global_epoch = 1;
+static epoch_record_t *records;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static epoch_retired_t *retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+
+static void record_release(void *data) {
+    epoch_record_t *record = data;
+
+    __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_record_key(void) { pthread_key_create(&record_key, record_release); }
+
+static epoch_record_t *get_record(void) {
+    epoch_record_t *record;
+
+    if (thread_epoch.record)
+        return thread_epoch.record;
+
+    /* take over the record of a thread that has exited */
+    for (record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record;
+         record = record->next) {
+        int free_record = 0;
+
+        if (__atomic_compare_exchange_n(&record->in_use, &free_record, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!record) {
+        record = malloc(sizeof(epoch_record_t));
+        if (!record)
+            return NULL;
+
+        record->epoch = 0;
+        record->in_use = 1;
+        record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &record->next, record, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_once(&key_once, make_record_key);
+    pthread_setspecific(record_key, record);
+    thread_epoch.record = record;
+    return record;
+}
+
+int json_epoch_enter(void) {
+    epoch_record_t *record;
+
+    if (thread_epoch.nesting++)
+        return 0;
+
+    record = get_record();
+    if (!record) {
+        thread_epoch.nesting = 0;
+        return -1;
+    }
+
+    __atomic_store_n(&record->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    /* the announcement must be visible before the reader loads any
+       pointer to a tree */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void json_epoch_leave(void) {
+    if (!thread_epoch.nesting || --thread_epoch.nesting)
+        return;
+
+    __atomic_store_n(&thread_epoch.record->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void json_reclaim(void) {
+    epoch_record_t *record;
+    epoch_retired_t **link, *done = NULL;
+    size_t oldest = (size_t)-1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for (record = __atomic_load_n(&records, __ATOMIC_ACQUIRE); record;
+         record = record->next) {
+        size_t epoch = __atomic_load_n(&record->epoch, __ATOMIC_ACQUIRE);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+
+    pthread_mutex_lock(&retired_lock);
+    link = &retired;
+    while (*link) {
+        epoch_retired_t *entry = *link;
+
+        if (entry->epoch < oldest) {
+            *link = entry->next;
+            entry->next = done;
+            done = entry;
+        } else
+            link = &entry->next;
+    }
+    pthread_mutex_unlock(&retired_lock);
+
+    while (done) {
+        epoch_retired_t *next = done->next;
+
+        jsonp_frozen_free(done->json);
+        jsonp_free(done);
+        done = next;
+    }
+}
+
+int json_retire(json_t *json) {
+    epoch_retired_t *entry;
+
+    if (!json)
+        return 0;
+
+    if (!json_is_frozen(json)) {
+        json_decref(json);
+        return 0;
+    }
+
+    /* the tree is leaked rather than freed too early */
+    entry = jsonp_malloc(sizeof(epoch_retired_t));
+    if (!entry)
+        return -1;
+
+    entry->json = json;
+
+    pthread_mutex_lock(&retired_lock);
+    entry->epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    entry->next = retired;
+    retired = entry;
+    pthread_mutex_unlock(&retired_lock);
+
+    json_reclaim();
+    return 0;
+}
+
+#else /* _WIN32 or no atomic builtins */
+
+/* Readers can't be tracked here, so json_retire() frees at once and
+   the caller must know that no reader is left. */
+int json_epoch_enter(void) { return 0; }
+
+void json_epoch_leave(void) {}
+
+void json_reclaim(void) {}
+
+int json_retire(json_t *json) {
+    if (json_is_frozen(json))
+        jsonp_frozen_free(json);
+    else
+        json_decref(json);
+    return 0;
+}
+
+#endif
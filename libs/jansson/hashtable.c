@@ -20,183 +20,439 @@
 #include "jansson_private.h" /* for container_of() */
 #include <jansson_config.h>  /* for JSON_INLINE */
 
-#ifndef INITIAL_HASHTABLE_ORDER
-#define INITIAL_HASHTABLE_ORDER 3
+#ifdef JSON_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef INITIAL_HASHTABLE_CAPACITY
+#define INITIAL_HASHTABLE_CAPACITY 16
+#endif
+
+/* Tables with up to this many pairs have no slot array. Lookups
+   compare key lengths and bytes along the ordered array, and keys are
+   only hashed once the table grows past it. */
+#ifndef SMALL_HASHTABLE_SIZE
+#define SMALL_HASHTABLE_SIZE 8
 #endif
 
-typedef struct hashtable_list list_t;
 typedef struct hashtable_pair pair_t;
-typedef struct hashtable_bucket bucket_t;
 
 extern volatile uint32_t hashtable_seed;
 
-/* Implementation of the hash function */
+/* Implementation of the hash function. wyhash is the default, define
+   JANSSON_HASH_LOOKUP3 to go back to Bob Jenkins' lookup3. Both are
+   keyed with the random hashtable seed. */
+#ifdef JANSSON_HASH_LOOKUP3
 #include "lookup3.h"
-
-#define list_to_pair(list_) container_of(list_, pair_t, list)
-#define ordered_list_to_pair(list_) container_of(list_, pair_t, ordered_list)
 #define hash_str(key, len) ((size_t)hashlittle((key), len, hashtable_seed))
+#else
+#include "wyhash.h"
+#define hash_str(key, len) ((size_t)wyhash((key), len, hashtable_seed))
+#endif
 
-static JSON_INLINE void list_init(list_t *list) {
-  list->next = list;
-  list->prev = list;
+/* Pairs cache the hash of their key, 0 meaning it was never computed,
+   so a key never hashes to 0 */
+static JSON_INLINE size_t hash_key(const char *key, size_t key_len) {
+  size_t hash = hash_str(key, key_len);
+  return hash ? hash : 1;
 }
 
-static JSON_INLINE void list_insert(list_t *list, list_t *node) {
-  node->next = list;
-  node->prev = list->prev;
-  list->prev->next = node;
-  list->prev = node;
+/* Control bytes: a full slot holds the low 7 bits of its pair's hash
+   (h2), free slots have the high bit set. The rest of the hash (h1)
+   picks the group where probing starts. */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xFE
+
+#define hash_h1(hash) ((hash) >> 7)
+#define hash_h2(hash) ((unsigned char)((hash)&0x7F))
+
+/* Probing looks at a group of control bytes at once. Groups are
+   aligned, so the capacity is never below GROUP_WIDTH. */
+#ifdef JSON_HAVE_SSE2
+
+#define GROUP_WIDTH 16
+typedef uint32_t group_mask_t;
+
+static JSON_INLINE group_mask_t group_match(const unsigned char *ctrl,
+                                            unsigned char h2) {
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (group_mask_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
 }
 
-static JSON_INLINE void list_remove(list_t *list) {
-  list->prev->next = list->next;
-  list->next->prev = list->prev;
+static JSON_INLINE group_mask_t group_match_empty(const unsigned char *ctrl) {
+  return group_match(ctrl, CTRL_EMPTY);
 }
 
-static JSON_INLINE int bucket_is_empty(hashtable_t *hashtable,
-                                       bucket_t *bucket) {
-  return bucket->first == &hashtable->list && bucket->first == bucket->last;
+static JSON_INLINE group_mask_t group_match_free(const unsigned char *ctrl) {
+  __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+  return (group_mask_t)_mm_movemask_epi8(group);
 }
 
-static void insert_to_bucket(hashtable_t *hashtable, bucket_t *bucket,
-                             list_t *list) {
-  if (bucket_is_empty(hashtable, bucket)) {
-    list_insert(&hashtable->list, list);
-    bucket->first = bucket->last = list;
-  } else {
-    list_insert(bucket->first, list);
-    bucket->first = list;
+#define mask_index_shift 0
+
+#else
+
+/* Portable fallback working on 8 control bytes in a 64-bit word. Each
+   match sets the high bit of the matching byte. */
+#define GROUP_WIDTH 8
+typedef uint64_t group_mask_t;
+
+#define GROUP_LSB 0x0101010101010101ULL
+#define GROUP_MSB 0x8080808080808080ULL
+
+static JSON_INLINE uint64_t group_load(const unsigned char *ctrl) {
+  uint64_t word = 0;
+  int i;
+
+  for (i = GROUP_WIDTH - 1; i >= 0; i--)
+    word = (word << 8) | ctrl[i];
+  return word;
+}
+
+static JSON_INLINE group_mask_t group_match(const unsigned char *ctrl,
+                                            unsigned char h2) {
+  /* may report false positives after a real match, which the key
+     comparison weeds out */
+  uint64_t x = group_load(ctrl) ^ (GROUP_LSB * h2);
+  return (x - GROUP_LSB) & ~x & GROUP_MSB;
+}
+
+static JSON_INLINE group_mask_t group_match_empty(const unsigned char *ctrl) {
+  /* empty is the only free byte with bit 1 clear */
+  uint64_t word = group_load(ctrl);
+  return word & ~(word << 6) & GROUP_MSB;
+}
+
+static JSON_INLINE group_mask_t group_match_free(const unsigned char *ctrl) {
+  return group_load(ctrl) & GROUP_MSB;
+}
+
+#define mask_index_shift 3
+
+#endif
+
+static JSON_INLINE size_t mask_first(group_mask_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (size_t)__builtin_ctzll(mask) >> mask_index_shift;
+#else
+  size_t i = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    i++;
   }
+  return i >> mask_index_shift;
+#endif
 }
 
-static pair_t *hashtable_find_pair(hashtable_t *hashtable, bucket_t *bucket,
-                                   const char *key, size_t key_len,
-                                   size_t hash) {
-  list_t *list;
-  pair_t *pair;
+#define mask_next(mask) ((mask) & ((mask)-1))
 
-  if (bucket_is_empty(hashtable, bucket))
-    return NULL;
+/* Triangular probing over aligned groups visits every group once when
+   the number of groups is a power of two */
+#define probe_start(hashtable, hash)                                           \
+  (hash_h1(hash) & ((hashtable)->capacity - 1) & ~(size_t)(GROUP_WIDTH - 1))
 
-  list = bucket->first;
-  while (1) {
-    pair = list_to_pair(list);
-    if (pair->hash == hash && pair->key_len == key_len &&
+/* Slots may use at most 7/8 of the table, counting deleted ones */
+#define max_used(capacity) ((capacity) - (capacity) / 8)
+
+#define hashtable_is_small(hashtable) ((hashtable)->capacity == 0)
+
+/* Whether inserting a key needs its hash, which small tables skip
+   until they are about to grow past SMALL_HASHTABLE_SIZE */
+#define hashtable_wants_hash(hashtable)                                        \
+  (!hashtable_is_small(hashtable) || (hashtable)->size >= SMALL_HASHTABLE_SIZE)
+
+static pair_t *hashtable_find_small(hashtable_t *hashtable, const char *key,
+                                    size_t key_len) {
+  size_t i;
+
+  for (i = 0; i < hashtable->ordered_len; i++) {
+    pair_t *pair = hashtable->ordered[i];
+    if (pair && pair->key_len == key_len &&
         memcmp(pair->key, key, key_len) == 0)
       return pair;
+  }
 
-    if (list == bucket->last)
-      break;
+  return NULL;
+}
+
+/* returns the slot of the pair, or (size_t)-1 if key was not found */
+static size_t hashtable_find_slot(hashtable_t *hashtable, const char *key,
+                                  size_t key_len, size_t hash) {
+  size_t pos, step = 0;
+  unsigned char h2 = hash_h2(hash);
+
+  pos = probe_start(hashtable, hash);
+  while (1) {
+    const unsigned char *group = hashtable->ctrl + pos;
+    group_mask_t match = group_match(group, h2);
 
-    list = list->next;
+    while (match) {
+      size_t slot = pos + mask_first(match);
+      pair_t *pair = hashtable->slots[slot];
+
+      if (group[slot - pos] == h2 && pair->hash == hash &&
+          pair->key_len == key_len && memcmp(pair->key, key, key_len) == 0)
+        return slot;
+
+      match = mask_next(match);
+    }
+
+    if (group_match_empty(group))
+      return (size_t)-1;
+
+    step += GROUP_WIDTH;
+    pos = (pos + step) & (hashtable->capacity - 1);
   }
+}
 
-  return NULL;
+static pair_t *hashtable_find_pair(hashtable_t *hashtable, const char *key,
+                                   size_t key_len, size_t hash) {
+  size_t slot;
+
+  if (hashtable_is_small(hashtable))
+    return hashtable_find_small(hashtable, key, key_len);
+
+  slot = hashtable_find_slot(hashtable, key, key_len, hash);
+  return slot == (size_t)-1 ? NULL : hashtable->slots[slot];
+}
+
+/* returns the first free slot on the probe sequence of hash */
+static size_t hashtable_free_slot(hashtable_t *hashtable, size_t hash) {
+  size_t pos = probe_start(hashtable, hash), step = 0;
+
+  while (1) {
+    group_mask_t match = group_match_free(hashtable->ctrl + pos);
+    if (match)
+      return pos + mask_first(match);
+
+    step += GROUP_WIDTH;
+    pos = (pos + step) & (hashtable->capacity - 1);
+  }
+}
+
+static void hashtable_put_slot(hashtable_t *hashtable, pair_t *pair) {
+  size_t slot = hashtable_free_slot(hashtable, pair->hash);
+
+  if (hashtable->ctrl[slot] == CTRL_EMPTY)
+    hashtable->used++;
+  hashtable->ctrl[slot] = hash_h2(pair->hash);
+  hashtable->slots[slot] = pair;
+}
+
+/* Drop the holes deleted pairs left in the ordered array */
+static void hashtable_compact(hashtable_t *hashtable) {
+  size_t i, j = 0;
+
+  for (i = 0; i < hashtable->ordered_len; i++) {
+    pair_t *pair = hashtable->ordered[i];
+    if (pair) {
+      pair->index = j;
+      hashtable->ordered[j++] = pair;
+    }
+  }
+  hashtable->ordered_len = j;
+}
+
+static void hashtable_del_slot(hashtable_t *hashtable, size_t slot) {
+  /* No probe sequence goes past a group that has an empty slot, so the
+     slot can become empty again in that case */
+  size_t pos = slot & ~(size_t)(GROUP_WIDTH - 1);
+
+  if (group_match_empty(hashtable->ctrl + pos)) {
+    hashtable->ctrl[slot] = CTRL_EMPTY;
+    hashtable->used--;
+  } else
+    hashtable->ctrl[slot] = CTRL_DELETED;
 }
 
 /* returns 0 on success, -1 if key was not found */
 static int hashtable_do_del(hashtable_t *hashtable, const char *key,
-                            size_t key_len, size_t hash) {
+                            size_t key_len) {
   pair_t *pair;
-  bucket_t *bucket;
-  size_t index;
+  size_t slot;
 
-  index = hash & hashmask(hashtable->order);
-  bucket = &hashtable->buckets[index];
-
-  pair = hashtable_find_pair(hashtable, bucket, key, key_len, hash);
-  if (!pair)
-    return -1;
-
-  if (&pair->list == bucket->first && &pair->list == bucket->last)
-    bucket->first = bucket->last = &hashtable->list;
+  if (hashtable_is_small(hashtable)) {
+    pair = hashtable_find_small(hashtable, key, key_len);
+    if (!pair)
+      return -1;
+  } else {
+    slot = hashtable_find_slot(hashtable, key, key_len,
+                               hash_key(key, key_len));
+    if (slot == (size_t)-1)
+      return -1;
 
-  else if (&pair->list == bucket->first)
-    bucket->first = pair->list.next;
+    pair = hashtable->slots[slot];
+    hashtable_del_slot(hashtable, slot);
+  }
 
-  else if (&pair->list == bucket->last)
-    bucket->last = pair->list.prev;
+  hashtable->ordered[pair->index] = NULL;
+  if (pair->index + 1 == hashtable->ordered_len)
+    hashtable->ordered_len--;
 
-  list_remove(&pair->list);
-  list_remove(&pair->ordered_list);
   json_decref(pair->value);
 
   jsonp_free(pair);
   hashtable->size--;
 
+  if (hashtable->ordered_len - hashtable->size > hashtable->ordered_len / 2)
+    hashtable_compact(hashtable);
+
   return 0;
 }
 
 static void hashtable_do_clear(hashtable_t *hashtable) {
-  list_t *list, *next;
+  size_t i;
   pair_t *pair;
 
-  for (list = hashtable->list.next; list != &hashtable->list; list = next) {
-    next = list->next;
-    pair = list_to_pair(list);
-    json_decref(pair->value);
-    jsonp_free(pair);
+  for (i = 0; i < hashtable->ordered_len; i++) {
+    pair = hashtable->ordered[i];
+    if (pair) {
+      json_decref(pair->value);
+      jsonp_free(pair);
+    }
   }
 }
 
-static int hashtable_do_rehash(hashtable_t *hashtable) {
-  list_t *list, *next;
-  pair_t *pair;
-  size_t i, index, new_size, new_order;
-  struct hashtable_bucket *new_buckets;
+static int hashtable_do_rehash(hashtable_t *hashtable, size_t new_capacity) {
+  size_t i;
+  unsigned char *new_ctrl;
+  pair_t **new_slots;
+
+  /* slots and control bytes share one allocation */
+  new_slots = jsonp_malloc(new_capacity * (sizeof(pair_t *) + 1));
+  if (!new_slots)
+    return -1;
+
+  new_ctrl = (unsigned char *)(new_slots + new_capacity);
+  memset(new_ctrl, CTRL_EMPTY, new_capacity);
+
+  jsonp_free(hashtable->slots);
+  hashtable->slots = new_slots;
+  hashtable->ctrl = new_ctrl;
+  hashtable->capacity = new_capacity;
+  hashtable->used = 0;
+
+  for (i = 0; i < hashtable->ordered_len; i++) {
+    if (hashtable->ordered[i])
+      hashtable_put_slot(hashtable, hashtable->ordered[i]);
+  }
+
+  return 0;
+}
+
+/* Keys of a small table are only hashed if they came with a hash */
+static int hashtable_promote(hashtable_t *hashtable, size_t capacity) {
+  size_t i;
+
+  for (i = 0; i < hashtable->ordered_len; i++) {
+    pair_t *pair = hashtable->ordered[i];
+    if (pair && !pair->hash)
+      pair->hash = hash_key(pair->key, pair->key_len);
+  }
+
+  return hashtable_do_rehash(hashtable, capacity);
+}
+
+static int hashtable_resize_ordered(hashtable_t *hashtable, size_t new_size) {
+  pair_t **new_ordered;
 
-  new_order = hashtable->order + 1;
-  new_size = hashsize(new_order);
+  if (new_size > (size_t)-1 / sizeof(pair_t *))
+    return -1;
 
-  new_buckets = jsonp_malloc(new_size * sizeof(bucket_t));
-  if (!new_buckets)
+  new_ordered = jsonp_malloc(new_size * sizeof(pair_t *));
+  if (!new_ordered)
     return -1;
 
-  jsonp_free(hashtable->buckets);
-  hashtable->buckets = new_buckets;
-  hashtable->order = new_order;
+  if (hashtable->ordered_len)
+    memcpy(new_ordered, hashtable->ordered,
+           hashtable->ordered_len * sizeof(pair_t *));
+  jsonp_free(hashtable->ordered);
+  hashtable->ordered = new_ordered;
+  hashtable->ordered_size = new_size;
+
+  return 0;
+}
+
+/* make room for one more pair */
+static int hashtable_make_room(hashtable_t *hashtable) {
+  if (hashtable_is_small(hashtable)) {
+    if (hashtable->size >= SMALL_HASHTABLE_SIZE &&
+        hashtable_promote(hashtable, INITIAL_HASHTABLE_CAPACITY))
+      return -1;
+  } else if (hashtable->used + 1 > max_used(hashtable->capacity)) {
+    size_t new_capacity = hashtable->capacity;
 
-  for (i = 0; i < new_size; i++) {
-    hashtable->buckets[i].first = hashtable->buckets[i].last = &hashtable->list;
+    if (hashtable->size + 1 > max_used(hashtable->capacity) / 2) {
+      /* otherwise mostly deleted slots, rehash at the same size */
+      new_capacity *= 2;
+    }
+
+    if (new_capacity > (size_t)-1 / (sizeof(pair_t *) + 1) ||
+        hashtable_do_rehash(hashtable, new_capacity))
+      return -1;
   }
 
-  list = hashtable->list.next;
-  list_init(&hashtable->list);
+  if (hashtable->ordered_len == hashtable->ordered_size) {
+    if (hashtable->ordered_len > hashtable->size) {
+      hashtable_compact(hashtable);
+      return 0;
+    }
 
-  for (; list != &hashtable->list; list = next) {
-    next = list->next;
-    pair = list_to_pair(list);
-    index = pair->hash % new_size;
-    insert_to_bucket(hashtable, &hashtable->buckets[index], &pair->list);
+    return hashtable_resize_ordered(hashtable,
+                                    hashtable->ordered_size
+                                        ? hashtable->ordered_size * 2
+                                        : SMALL_HASHTABLE_SIZE);
   }
 
   return 0;
 }
 
-int hashtable_init(hashtable_t *hashtable) {
-  size_t i;
+int hashtable_reserve(hashtable_t *hashtable, size_t size) {
+  size_t capacity = hashtable_is_small(hashtable) ? INITIAL_HASHTABLE_CAPACITY
+                                                  : hashtable->capacity;
 
-  hashtable->size = 0;
-  hashtable->order = INITIAL_HASHTABLE_ORDER;
-  hashtable->buckets =
-      jsonp_malloc(hashsize(hashtable->order) * sizeof(bucket_t));
-  if (!hashtable->buckets)
+  if (size > hashtable->ordered_size &&
+      hashtable_resize_ordered(hashtable, size))
     return -1;
 
-  list_init(&hashtable->list);
-  list_init(&hashtable->ordered_list);
+  if (size <= SMALL_HASHTABLE_SIZE)
+    return 0;
 
-  for (i = 0; i < hashsize(hashtable->order); i++) {
-    hashtable->buckets[i].first = hashtable->buckets[i].last = &hashtable->list;
+  if (!hashtable_is_small(hashtable) &&
+      hashtable->used - hashtable->size + size <=
+          max_used(hashtable->capacity))
+    return 0;
+
+  while (max_used(capacity) < size) {
+    if (capacity > (size_t)-1 / 2 / (sizeof(pair_t *) + 1))
+      return -1;
+    capacity *= 2;
   }
 
+  if (hashtable_is_small(hashtable))
+    return hashtable_promote(hashtable, capacity);
+
+  return hashtable_do_rehash(hashtable, capacity);
+}
+
+int hashtable_init(hashtable_t *hashtable) {
+  hashtable->size = 0;
+  hashtable->capacity = 0;
+  hashtable->used = 0;
+  hashtable->ctrl = NULL;
+  hashtable->slots = NULL;
+  hashtable->ordered = NULL;
+  hashtable->ordered_len = 0;
+  hashtable->ordered_size = 0;
+
   return 0;
 }
 
 void hashtable_close(hashtable_t *hashtable) {
   hashtable_do_clear(hashtable);
-  jsonp_free(hashtable->buckets);
+  jsonp_free(hashtable->slots);
+  jsonp_free(hashtable->ordered);
 }
 
 static pair_t *init_pair(json_t *value, const char *key, size_t key_len,
@@ -223,123 +479,135 @@ static pair_t *init_pair(json_t *value, const char *key, size_t key_len,
   pair->key_len = key_len;
   pair->value = value;
 
-  list_init(&pair->list);
-  list_init(&pair->ordered_list);
-
   return pair;
 }
 
-int hashtable_set(hashtable_t *hashtable, const char *key, size_t key_len,
-                  json_t *value) {
+/* hash may be 0 if the table is small after making room */
+static int hashtable_do_set(hashtable_t *hashtable, const char *key,
+                            size_t key_len, size_t hash, json_t *value) {
   pair_t *pair;
-  bucket_t *bucket;
-  size_t hash, index;
 
-  /* rehash if the load ratio exceeds 1 */
-  if (hashtable->size >= hashsize(hashtable->order))
-    if (hashtable_do_rehash(hashtable))
-      return -1;
-
-  hash = hash_str(key, key_len);
-  index = hash & hashmask(hashtable->order);
-  bucket = &hashtable->buckets[index];
-  pair = hashtable_find_pair(hashtable, bucket, key, key_len, hash);
+  pair = hashtable_find_pair(hashtable, key, key_len, hash);
 
   if (pair) {
     json_decref(pair->value);
     pair->value = value;
   } else {
+    if (hashtable_make_room(hashtable))
+      return -1;
+
     pair = init_pair(value, key, key_len, hash);
 
     if (!pair)
       return -1;
 
-    insert_to_bucket(hashtable, bucket, &pair->list);
-    list_insert(&hashtable->ordered_list, &pair->ordered_list);
+    if (!hashtable_is_small(hashtable))
+      hashtable_put_slot(hashtable, pair);
+    pair->index = hashtable->ordered_len++;
+    hashtable->ordered[pair->index] = pair;
 
     hashtable->size++;
   }
   return 0;
 }
 
+int hashtable_set(hashtable_t *hashtable, const char *key, size_t key_len,
+                  json_t *value) {
+  return hashtable_set_hashed(hashtable, key, key_len, 0, value);
+}
+
+int hashtable_set_hashed(hashtable_t *hashtable, const char *key,
+                         size_t key_len, size_t hash, json_t *value) {
+  if (!hash && hashtable_wants_hash(hashtable))
+    hash = hash_key(key, key_len);
+
+  return hashtable_do_set(hashtable, key, key_len, hash, value);
+}
+
 void *hashtable_get(hashtable_t *hashtable, const char *key, size_t key_len) {
+  return hashtable_get_hashed(hashtable, key, key_len, 0);
+}
+
+void *hashtable_get_hashed(hashtable_t *hashtable, const char *key,
+                           size_t key_len, size_t hash) {
   pair_t *pair;
-  size_t hash;
-  bucket_t *bucket;
 
-  hash = hash_str(key, key_len);
-  bucket = &hashtable->buckets[hash & hashmask(hashtable->order)];
+  if (hashtable_is_small(hashtable))
+    pair = hashtable_find_small(hashtable, key, key_len);
+  else
+    pair = hashtable_find_pair(hashtable, key, key_len,
+                               hash ? hash : hash_key(key, key_len));
 
-  pair = hashtable_find_pair(hashtable, bucket, key, key_len, hash);
-  if (!pair)
-    return NULL;
+  return pair ? pair->value : NULL;
+}
 
-  return pair->value;
+size_t hashtable_hash(hashtable_t *hashtable, const char *key,
+                      size_t key_len) {
+  return hashtable_wants_hash(hashtable) ? hash_key(key, key_len) : 0;
 }
 
 int hashtable_del(hashtable_t *hashtable, const char *key, size_t key_len) {
-  size_t hash = hash_str(key, key_len);
-  return hashtable_do_del(hashtable, key, key_len, hash);
+  return hashtable_do_del(hashtable, key, key_len);
 }
 
 void hashtable_clear(hashtable_t *hashtable) {
-  size_t i;
-
   hashtable_do_clear(hashtable);
 
-  for (i = 0; i < hashsize(hashtable->order); i++) {
-    hashtable->buckets[i].first = hashtable->buckets[i].last = &hashtable->list;
-  }
+  if (hashtable->capacity)
+    memset(hashtable->ctrl, CTRL_EMPTY, hashtable->capacity);
 
-  list_init(&hashtable->list);
-  list_init(&hashtable->ordered_list);
+  hashtable->used = 0;
+  hashtable->ordered_len = 0;
   hashtable->size = 0;
 }
 
+static void *hashtable_iter_from(hashtable_t *hashtable, size_t index) {
+  for (; index < hashtable->ordered_len; index++) {
+    if (hashtable->ordered[index])
+      return hashtable->ordered[index];
+  }
+  return NULL;
+}
+
 void *hashtable_iter(hashtable_t *hashtable) {
-  return hashtable_iter_next(hashtable, &hashtable->ordered_list);
+  return hashtable_iter_from(hashtable, 0);
 }
 
 void *hashtable_iter_at(hashtable_t *hashtable, const char *key,
                         size_t key_len) {
-  pair_t *pair;
-  size_t hash;
-  bucket_t *bucket;
-
-  hash = hash_str(key, key_len);
-  bucket = &hashtable->buckets[hash & hashmask(hashtable->order)];
+  if (hashtable_is_small(hashtable))
+    return hashtable_find_small(hashtable, key, key_len);
 
-  pair = hashtable_find_pair(hashtable, bucket, key, key_len, hash);
-  if (!pair)
-    return NULL;
-
-  return &pair->ordered_list;
+  return hashtable_find_pair(hashtable, key, key_len, hash_key(key, key_len));
 }
 
 void *hashtable_iter_next(hashtable_t *hashtable, void *iter) {
-  list_t *list = (list_t *)iter;
-  if (list->next == &hashtable->ordered_list)
-    return NULL;
-  return list->next;
+  pair_t *pair = (pair_t *)iter;
+  return hashtable_iter_from(hashtable, pair->index + 1);
 }
 
 void *hashtable_iter_key(void *iter) {
-  pair_t *pair = ordered_list_to_pair((list_t *)iter);
+  pair_t *pair = (pair_t *)iter;
   return pair->key;
 }
 
 size_t hashtable_iter_key_len(void *iter) {
-  pair_t *pair = ordered_list_to_pair((list_t *)iter);
+  pair_t *pair = (pair_t *)iter;
   return pair->key_len;
 }
 
+size_t hashtable_iter_hash(void *iter) {
+  pair_t *pair = (pair_t *)iter;
+  return pair->hash;
+}
+
 void *hashtable_iter_value(void *iter) {
-  pair_t *pair = ordered_list_to_pair((list_t *)iter);
+  pair_t *pair = (pair_t *)iter;
   return pair->value;
 }
 
 void hashtable_iter_set(void *iter, json_t *value) {
-  pair_t *pair = ordered_list_to_pair((list_t *)iter);
+  pair_t *pair = (pair_t *)iter;
 
   json_decref(pair->value);
   pair->value = value;
@@ -11,38 +11,35 @@
 #include "jansson.h"
 #include <stdlib.h>
 
-struct hashtable_list {
-    struct hashtable_list *prev;
-    struct hashtable_list *next;
-};
-
 /* "pair" may be a bit confusing a name, but think of it as a
    key-value pair. In this case, it just encodes some extra data,
    too */
 struct hashtable_pair {
-    struct hashtable_list list;
-    struct hashtable_list ordered_list;
-    size_t hash;
+    size_t hash;  /* 0 until the key is hashed */
+    size_t index; /* position in the ordered array */
     json_t *value;
     size_t key_len;
     char key[1];
 };
 
-struct hashtable_bucket {
-    struct hashtable_list *first;
-    struct hashtable_list *last;
-};
-
+/* Open addressing with one control byte per slot, probed a group of
+   slots at a time. Pairs are allocated separately so that pointers to
+   them (iterators, keys) stay valid while the table grows, and
+   insertion order is kept in a dense array of pair pointers. Small
+   tables have no slots and are searched through that array alone. */
 typedef struct hashtable {
-    size_t size;
-    struct hashtable_bucket *buckets;
-    size_t order; /* hashtable has pow(2, order) buckets */
-    struct hashtable_list list;
-    struct hashtable_list ordered_list;
+    size_t size;     /* number of pairs */
+    size_t capacity; /* number of slots, 0 or a power of two */
+    size_t used;     /* slots that are full or deleted */
+    unsigned char *ctrl;
+    struct hashtable_pair **slots;
+    struct hashtable_pair **ordered; /* NULL where a pair was deleted */
+    size_t ordered_len;
+    size_t ordered_size;
 } hashtable_t;
 
 #define hashtable_key_to_iter(key_)                                                      \
-    (&(container_of(key_, struct hashtable_pair, key)->ordered_list))
+    ((void *)container_of(key_, struct hashtable_pair, key))
 
 /**
  * hashtable_init - Initialize a hashtable object
@@ -51,11 +48,25 @@ typedef struct hashtable {
  *
  * Initializes a statically allocated hashtable object. The object
  * should be cleared with hashtable_close when it's no longer used.
+ * No memory is allocated until the first value is set.
  *
  * Returns 0 on success, -1 on error (out of memory).
  */
 int hashtable_init(hashtable_t *hashtable) JANSSON_ATTRS((warn_unused_result));
 
+/**
+ * hashtable_reserve - Make room for a number of pairs
+ *
+ * @hashtable: The hashtable object
+ * @size: The number of pairs the hashtable should hold
+ *
+ * Grows the hashtable so that it can hold size pairs without being
+ * resized again. Never shrinks it.
+ *
+ * Returns 0 on success, -1 on error (out of memory).
+ */
+int hashtable_reserve(hashtable_t *hashtable, size_t size);
+
 /**
  * hashtable_close - Release all resources used by a hashtable object
  *
@@ -82,6 +93,22 @@ void hashtable_close(hashtable_t *hashtable);
  */
 int hashtable_set(hashtable_t *hashtable, const char *key, size_t key_len, json_t *value);
 
+/**
+ * hashtable_set_hashed - Add/modify value with a known key hash
+ *
+ * @hashtable: The hashtable object
+ * @key: The key
+ * @key_len: The length of key
+ * @hash: The hash of key, or 0 if not known
+ * @value: The value
+ *
+ * Like hashtable_set(), but uses hash instead of hashing key again.
+ * The pair keeps the hash, so a small table that grows does not have
+ * to hash the key either.
+ */
+int hashtable_set_hashed(hashtable_t *hashtable, const char *key, size_t key_len,
+                         size_t hash, json_t *value);
+
 /**
  * hashtable_get - Get a value associated with a key
  *
@@ -93,6 +120,32 @@ int hashtable_set(hashtable_t *hashtable, const char *key, size_t key_len, json_
  */
 void *hashtable_get(hashtable_t *hashtable, const char *key, size_t key_len);
 
+/**
+ * hashtable_get_hashed - Get a value with a known key hash
+ *
+ * @hashtable: The hashtable object
+ * @key: The key
+ * @key_len: The length of key
+ * @hash: The hash of key, or 0 if not known
+ *
+ * Like hashtable_get(), but uses hash instead of hashing key again.
+ */
+void *hashtable_get_hashed(hashtable_t *hashtable, const char *key, size_t key_len,
+                           size_t hash);
+
+/**
+ * hashtable_hash - Hash a key for a table
+ *
+ * @hashtable: The hashtable object
+ * @key: The key
+ * @key_len: The length of key
+ *
+ * Returns the hash of key, or 0 if the table is small enough that
+ * inserting key would not need it. A non-zero hash is valid for every
+ * table, as all of them share the hashtable seed.
+ */
+size_t hashtable_hash(hashtable_t *hashtable, const char *key, size_t key_len);
+
 /**
  * hashtable_del - Remove a value from the hashtable
  *
@@ -167,6 +220,15 @@ void *hashtable_iter_key(void *iter);
  */
 size_t hashtable_iter_key_len(void *iter);
 
+/**
+ * hashtable_iter_hash - Retrieve the key hash cached at an iterator
+ *
+ * @iter: The iterator
+ *
+ * Returns 0 if the key has not been hashed.
+ */
+size_t hashtable_iter_hash(void *iter);
+
 /**
  * hashtable_iter_value - Retrieve the value pointed by an iterator
  *
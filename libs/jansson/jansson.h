@@ -60,9 +60,15 @@ typedef enum {
 
 typedef struct json_t {
   json_type type;
+  unsigned int flags; /* JSON_VALUE_* */
   volatile size_t refcount;
 } json_t;
 
+/* refcount is changed without atomic instructions, see json_confine() */
+#define JSON_VALUE_CONFINED 0x1
+/* part of an immutable tree, see json_freeze() */
+#define JSON_VALUE_FROZEN 0x2
+
 #ifndef JANSSON_USING_CMAKE /* disabled if using cmake */
 #if JSON_INTEGER_IS_LONG_LONG
 #ifdef _WIN32
@@ -89,11 +95,16 @@ typedef long json_int_t;
 #define json_boolean_value json_is_true
 #define json_is_boolean(json) (json_is_true(json) || json_is_false(json))
 #define json_is_null(json) ((json) && json_typeof(json) == JSON_NULL)
+#define json_is_frozen(json) ((json) && ((json)->flags & JSON_VALUE_FROZEN))
 
 /* construction, destruction, reference counting */
 
 json_t *json_object(void);
+json_t *json_object_with_capacity(size_t size);
 json_t *json_array(void);
+json_t *json_array_with_capacity(size_t size);
+json_t *json_array_doubles(const double *values, size_t n);
+json_t *json_array_integers(const json_int_t *values, size_t n);
 json_t *json_string(const char *value);
 json_t *json_stringn(const char *value, size_t len);
 json_t *json_string_nocheck(const char *value);
@@ -120,8 +131,12 @@ json_t *json_null(void);
 #endif
 
 static JSON_INLINE json_t *json_incref(json_t *json) {
-  if (json && json->refcount != (size_t)-1)
-    JSON_INTERNAL_INCREF(json);
+  if (json && json->refcount != (size_t)-1) {
+    if (json->flags & JSON_VALUE_CONFINED)
+      ++json->refcount;
+    else
+      JSON_INTERNAL_INCREF(json);
+  }
   return json;
 }
 
@@ -129,10 +144,30 @@ static JSON_INLINE json_t *json_incref(json_t *json) {
 void json_delete(json_t *json);
 
 static JSON_INLINE void json_decref(json_t *json) {
-  if (json && json->refcount != (size_t)-1 && JSON_INTERNAL_DECREF(json) == 0)
+  if (json && json->refcount != (size_t)-1 &&
+      ((json->flags & JSON_VALUE_CONFINED) ? --json->refcount
+                                           : JSON_INTERNAL_DECREF(json)) == 0)
     json_delete(json);
 }
 
+/* thread confinement: json_confine() makes reference counting in a
+   tree that only one thread uses non-atomic, json_share() makes it
+   atomic again and must be called before the tree is handed to
+   another thread; both return 0 on success and -1 on error */
+int json_confine(json_t *json);
+int json_share(json_t *json);
+
+/* immutable trees: json_freeze() takes the reference to json and
+   returns it, or a copy if other references exist, made read-only
+   with reference counting turned off (NULL on error). Readers use it
+   between json_epoch_enter() and json_epoch_leave(); once no longer
+   reachable, json_retire() frees it when those readers are done. */
+json_t *json_freeze(json_t *json) JANSSON_ATTRS((warn_unused_result));
+int json_epoch_enter(void);
+void json_epoch_leave(void);
+int json_retire(json_t *json);
+void json_reclaim(void);
+
 #if defined(__GNUC__) || defined(__clang__)
 static JSON_INLINE void json_decrefp(json_t **json) {
   if (json) {
@@ -294,6 +329,8 @@ static JSON_INLINE int json_object_update_missing_new(json_t *object,
 size_t json_array_size(const json_t *array);
 json_t *json_array_get(const json_t *array, size_t index)
     JANSSON_ATTRS((warn_unused_result));
+size_t json_array_get_doubles(const json_t *array, double *out, size_t n);
+size_t json_array_get_integers(const json_t *array, json_int_t *out, size_t n);
 int json_array_set_new(json_t *array, size_t index, json_t *value);
 int json_array_append_new(json_t *array, json_t *value);
 int json_array_insert_new(json_t *array, size_t index, json_t *value);
@@ -345,6 +382,44 @@ int json_unpack_ex(json_t *root, json_error_t *error, size_t flags,
 int json_vunpack_ex(json_t *root, json_error_t *error, size_t flags,
                     const char *fmt, va_list ap);
 
+/* format strings tokenized once for repeated json_pack_exec()/
+   json_unpack_exec() calls, which take the same arguments as
+   json_pack_ex()/json_unpack_ex() would. Only the tokenizing is
+   cached, the tokens are still interpreted on every call. */
+
+typedef struct json_format json_format_t;
+
+json_format_t *json_format_scan(const char *fmt)
+    JANSSON_ATTRS((warn_unused_result));
+json_t *json_pack_exec(const json_format_t *format, json_error_t *error,
+                       size_t flags, ...) JANSSON_ATTRS((warn_unused_result));
+json_t *json_vpack_exec(const json_format_t *format, json_error_t *error,
+                        size_t flags, va_list ap)
+    JANSSON_ATTRS((warn_unused_result));
+int json_unpack_exec(json_t *root, const json_format_t *format,
+                     json_error_t *error, size_t flags, ...);
+int json_vunpack_exec(json_t *root, const json_format_t *format,
+                      json_error_t *error, size_t flags, va_list ap);
+void json_format_free(json_format_t *format);
+
+/* compiled templates: the format is that of json_pack() with each
+   value argument being the offset of a struct member, rendering
+   needs no json_t values */
+
+typedef struct json_template json_template_t;
+
+json_template_t *json_template_compile(json_error_t *error, size_t flags,
+                                       const char *fmt, ...)
+    JANSSON_ATTRS((warn_unused_result));
+json_template_t *json_template_vcompile(json_error_t *error, size_t flags,
+                                        const char *fmt, va_list ap)
+    JANSSON_ATTRS((warn_unused_result));
+char *json_template_dumps(const json_template_t *tpl, const void *data,
+                          size_t *length) JANSSON_ATTRS((warn_unused_result));
+size_t json_template_dumpb(const json_template_t *tpl, const void *data,
+                           char *buffer, size_t size);
+void json_template_free(json_template_t *tpl);
+
 /* sprintf */
 
 json_t *json_sprintf(const char *fmt, ...)
@@ -368,6 +443,11 @@ json_t *json_deep_copy(const json_t *value) JANSSON_ATTRS((warn_unused_result));
 #define JSON_DECODE_ANY 0x4
 #define JSON_DECODE_INT_AS_REAL 0x8
 #define JSON_ALLOW_NUL 0x10
+#define JSON_PACKED_ARRAYS 0x40
+#define JSON_DECODE_CONFINED 0x80
+/* json_load_file() maps the file and strings without escapes point
+   into it, so it must not be truncated while one of them is alive */
+#define JSON_DECODE_MAPPED 0x100
 
 typedef size_t (*json_load_callback_t)(void *buffer, size_t buflen, void *data);
 
@@ -384,6 +464,102 @@ json_t *json_load_file(const char *path, size_t flags, json_error_t *error)
 json_t *json_load_callback(json_load_callback_t callback, void *data,
                            size_t flags, json_error_t *error)
     JANSSON_ATTRS((warn_unused_result));
+json_t *json_loadb_select(const char *buffer, size_t buflen,
+                          const char *const *paths, size_t npaths, size_t flags,
+                          json_error_t *error)
+    JANSSON_ATTRS((warn_unused_result));
+
+/* decoding into structs, returns 0 on success and -1 on error. Each
+   field binds a key to a struct member; other keys are skipped and
+   null values leave the member as it is. The table ends with a NULL
+   key. JSON_FIELD_STRING members should start out NULL: a previous
+   value is freed when replaced, and the caller frees the last one,
+   after errors too. */
+
+#define JSON_FIELD_INT 1     /* int */
+#define JSON_FIELD_INTEGER 2 /* json_int_t */
+#define JSON_FIELD_REAL 3    /* double, integers are converted */
+#define JSON_FIELD_BOOLEAN 4 /* int */
+#define JSON_FIELD_STRING 5  /* char *, allocated */
+#define JSON_FIELD_CHARS 6   /* char[size], NUL terminated */
+#define JSON_FIELD_OBJECT 7  /* struct described by fields */
+
+typedef struct json_field {
+  const char *key;
+  int type;
+  size_t offset;
+  size_t size;                     /* JSON_FIELD_CHARS */
+  const struct json_field *fields; /* JSON_FIELD_OBJECT */
+} json_field_t;
+
+int json_loadb_struct(const char *buffer, size_t buflen,
+                      const json_field_t *fields, void *data, size_t flags,
+                      json_error_t *error);
+int json_loadb_struct_array(const char *buffer, size_t buflen,
+                            const json_field_t *fields, void *items,
+                            size_t item_size, size_t max_items, size_t *count,
+                            size_t flags, json_error_t *error);
+
+/* event decoding, returns 0 on success, -1 on error and 1 if a handler
+   stopped the parse by returning nonzero; NULL handlers are skipped */
+
+typedef struct json_sax_handlers {
+  int (*null)(void *data);
+  int (*boolean)(void *data, int value);
+  int (*integer)(void *data, json_int_t value);
+  int (*real)(void *data, double value);
+  int (*string)(void *data, const char *value, size_t len);
+  int (*start_object)(void *data);
+  int (*key)(void *data, const char *key, size_t len);
+  int (*end_object)(void *data);
+  int (*start_array)(void *data);
+  int (*end_array)(void *data);
+} json_sax_handlers_t;
+
+int json_sax_loads(const char *input, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error);
+int json_sax_loadb(const char *buffer, size_t buflen, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error);
+int json_sax_loadf(FILE *input, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error);
+int json_sax_load_callback(json_load_callback_t callback, void *arg,
+                           size_t flags, const json_sax_handlers_t *handlers,
+                           void *data, json_error_t *error);
+
+/* incremental decoding. Feed the input as it arrives and a NULL
+   buffer at its end; feed returns 0 once a value is complete, 1 if more
+   input is needed and -1 on error. result returns a new reference, or
+   NULL and fills error. */
+
+#define JSON_PARSER_DONE 0
+#define JSON_PARSER_NEED_MORE 1
+
+typedef struct json_parser json_parser_t;
+
+json_parser_t *json_parser_new(size_t flags)
+    JANSSON_ATTRS((warn_unused_result));
+int json_parser_feed(json_parser_t *parser, const char *buffer, size_t buflen);
+json_t *json_parser_result(json_parser_t *parser, json_error_t *error)
+    JANSSON_ATTRS((warn_unused_result));
+void json_parser_free(json_parser_t *parser);
+
+/* newline-delimited decoding, one value per line, blank lines are
+   skipped. Lines are parsed on threads (0 for one per CPU) and passed
+   to the callback in input order with their line number; the value is
+   released when the callback returns. Returns 0 on success, -1 on
+   error and 1 if the callback stopped the load by returning nonzero. */
+
+typedef int (*json_ndjson_callback_t)(json_t *json, size_t line, void *data);
+
+int json_loadb_ndjson(const char *buffer, size_t buflen, size_t flags,
+                      size_t threads, json_ndjson_callback_t callback,
+                      void *data, json_error_t *error);
+int json_load_ndjson_file(const char *path, size_t flags, size_t threads,
+                          json_ndjson_callback_t callback, void *data,
+                          json_error_t *error);
 
 /* encoding */
 
@@ -403,6 +579,8 @@ typedef int (*json_dump_callback_t)(const char *buffer, size_t size,
 
 char *json_dumps(const json_t *json, size_t flags)
     JANSSON_ATTRS((warn_unused_result));
+char *json_dumpsn(const json_t *json, size_t flags, size_t *length)
+    JANSSON_ATTRS((warn_unused_result));
 size_t json_dumpb(const json_t *json, char *buffer, size_t size, size_t flags);
 int json_dumpf(const json_t *json, FILE *output, size_t flags);
 int json_dumpfd(const json_t *json, int output, size_t flags);
@@ -410,6 +588,71 @@ int json_dump_file(const json_t *json, const char *path, size_t flags);
 int json_dump_callback(const json_t *json, json_dump_callback_t callback,
                        void *data, size_t flags);
 
+/* CBOR (RFC 8949) encoding and decoding, with the flags of their JSON
+   counterparts. json_cbor_dumps stores the size of the result in
+   *length; json_cbor_dumpb returns the size even if buffer is too
+   small, and 0 on error. */
+
+char *json_cbor_dumps(const json_t *json, size_t flags, size_t *length)
+    JANSSON_ATTRS((warn_unused_result));
+size_t json_cbor_dumpb(const json_t *json, char *buffer, size_t size,
+                       size_t flags);
+json_t *json_cbor_loadb(const char *buffer, size_t buflen, size_t flags,
+                        json_error_t *error) JANSSON_ATTRS((warn_unused_result));
+
+/* tapes: a value flattened into typed 64-bit words and a string
+   arena, loaded by mapping the file without parsing anything. Values
+   on a tape are addressed by index and JSON_TAPE_NONE stands for a
+   missing one; json_tape_typeof returns -1 for it. The tape must
+   outlive the strings returned by json_tape_string_value. A buffer
+   passed to json_tape_loadb must be 8-byte aligned and stay valid
+   until the tape is freed. */
+
+#define JSON_TAPE_NONE ((size_t)-1)
+
+typedef struct json_tape json_tape_t;
+
+char *json_tape_dumps(const json_t *json, size_t *length)
+    JANSSON_ATTRS((warn_unused_result));
+int json_tape_dump_file(const json_t *json, const char *path);
+json_tape_t *json_tape_loadb(const char *buffer, size_t buflen,
+                             json_error_t *error)
+    JANSSON_ATTRS((warn_unused_result));
+json_tape_t *json_tape_load_file(const char *path, json_error_t *error)
+    JANSSON_ATTRS((warn_unused_result));
+void json_tape_free(json_tape_t *tape);
+
+#define json_tape_root(tape) ((size_t)0)
+int json_tape_typeof(const json_tape_t *tape, size_t value);
+size_t json_tape_size(const json_tape_t *tape, size_t value);
+size_t json_tape_child(const json_tape_t *tape, size_t value);
+size_t json_tape_next(const json_tape_t *tape, size_t value);
+size_t json_tape_array_get(const json_tape_t *tape, size_t array,
+                           size_t index);
+size_t json_tape_object_get(const json_tape_t *tape, size_t object,
+                            const char *key);
+size_t json_tape_object_getn(const json_tape_t *tape, size_t object,
+                             const char *key, size_t key_len);
+const char *json_tape_string_value(const json_tape_t *tape, size_t value);
+size_t json_tape_string_length(const json_tape_t *tape, size_t value);
+json_int_t json_tape_integer_value(const json_tape_t *tape, size_t value);
+double json_tape_real_value(const json_tape_t *tape, size_t value);
+double json_tape_number_value(const json_tape_t *tape, size_t value);
+json_t *json_tape_to_json(const json_tape_t *tape, size_t value)
+    JANSSON_ATTRS((warn_unused_result));
+
+/* resumable encoding, holds a reference to json until freed. read
+   returns 0 at the end and (size_t)-1 on error; write_chunked returns
+   0 when done, 1 when fd would block and -1 on error */
+
+typedef struct json_dumper json_dumper_t;
+
+json_dumper_t *json_dumper_new(json_t *json, size_t flags)
+    JANSSON_ATTRS((warn_unused_result));
+size_t json_dumper_read(json_dumper_t *dumper, char *buffer, size_t size);
+int json_dumper_write_chunked(json_dumper_t *dumper, int fd);
+void json_dumper_free(json_dumper_t *dumper);
+
 /* custom memory allocation */
 
 typedef void *(*json_malloc_t)(size_t);
@@ -424,6 +667,12 @@ void json_set_alloc_funcs2(json_malloc_t malloc_fn, json_realloc_t realloc_fn,
 void json_get_alloc_funcs2(json_malloc_t *malloc_fn, json_realloc_t *realloc_fn,
                            json_free_t *free_fn);
 
+/* per-thread pool allocator, install with json_set_alloc_funcs2() */
+
+void *json_pool_malloc(size_t size);
+void *json_pool_realloc(void *ptr, size_t size);
+void json_pool_free(void *ptr);
+
 /* runtime version checking */
 
 const char *jansson_version_str(void);
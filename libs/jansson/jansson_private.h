@@ -21,6 +21,21 @@
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
+/* Thread-local storage for the per-thread caches */
+#if defined(_MSC_VER)
+#define JSON_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define JSON_THREAD_LOCAL __thread
+#else
+#define JSON_THREAD_LOCAL _Thread_local
+#endif
+
+/* SSE2 is always there on x86-64 */
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSON_HAVE_SSE2 1
+#endif
+
 /* va_copy is a C99 feature. In C89 implementations, it's sometimes
    available as __va_copy. If not, memcpy() should do the trick. */
 #ifndef va_copy
@@ -36,11 +51,23 @@ typedef struct {
   hashtable_t hashtable;
 } json_object_t;
 
+/* Values of a packed array live in reals or integers. Their json_t
+   counterparts are only created when an element is asked for, so
+   table may be NULL or have NULL holes. */
+#define ARRAY_UNPACKED 0
+#define ARRAY_PACKED_REAL 1
+#define ARRAY_PACKED_INTEGER 2
+
 typedef struct {
   json_t json;
   size_t size;
   size_t entries;
   json_t **table;
+  int packed;
+  union {
+    double *reals;
+    json_int_t *integers;
+  } values;
 } json_array_t;
 
 typedef struct {
@@ -68,6 +95,42 @@ typedef struct {
 /* Create a string by taking ownership of an existing buffer */
 json_t *jsonp_stringn_nocheck_own(const char *value, size_t len);
 
+/* A file mapped by json_load_file() with JSON_DECODE_MAPPED. Strings
+   without escapes point into it, each holding a reference, and it is
+   unmapped with the last of them. */
+typedef struct {
+  char *base;
+  size_t size;
+  volatile size_t refcount;
+} jsonp_mapping_t;
+
+void jsonp_mapping_decref(jsonp_mapping_t *mapping);
+
+/* Create a string pointing into a mapping, value[len] must be '\0' */
+json_t *jsonp_stringn_nocheck_mapped(const char *value, size_t len,
+                                     jsonp_mapping_t *mapping);
+
+/* the json_string_t is part of a json_string_view_t, see value.c */
+#define JSON_VALUE_MAPPED 0x100
+
+/* Object access with a key hash from jsonp_object_hash() or another
+   object's pair, 0 if not known */
+size_t jsonp_object_hash(const json_t *json, const char *key, size_t key_len);
+json_t *jsonp_object_getn_hashed(const json_t *json, const char *key, size_t key_len,
+                                 size_t hash);
+int jsonp_object_setn_new_hashed(json_t *json, const char *key, size_t key_len,
+                                 size_t hash, json_t *value);
+
+/* Append a number to an array, keeping it packed if possible */
+int jsonp_array_append_real(json_t *json, double value);
+int jsonp_array_append_integer(json_t *json, json_int_t value);
+
+/* If the element at index only exists as a packed value, store it in
+   *integer or *real and return ARRAY_PACKED_*. Otherwise return
+   ARRAY_UNPACKED and read the element with json_array_get(). */
+int jsonp_array_packed_value(const json_t *json, size_t index, json_int_t *integer,
+                             double *real);
+
 /* Error message formatting */
 void jsonp_error_init(json_error_t *error, const char *source);
 void jsonp_error_set_source(json_error_t *error, const char *source);
@@ -89,11 +152,36 @@ void jsonp_free(void *ptr);
 char *jsonp_strndup(const char *str, size_t len)
     JANSSON_ATTRS((warn_unused_result));
 
-/* Circular reference check*/
-/* Space for "0x", double the sizeof a pointer for the hex and a terminator. */
-#define LOOP_KEY_LEN (2 + (sizeof(json_t *) * 2) + 1)
-int jsonp_loop_check(hashtable_t *parents, const json_t *json, char *key,
-                     size_t key_size, size_t *key_len_out);
+/* Circular reference check. The containers on the path from the root
+   are kept in a stack that is only allocated when nesting goes deeper
+   than PARENTS_INLINE. jsonp_loop_check() pushes json and fails if it
+   is already there, jsonp_loop_leave() pops it again. */
+#define PARENTS_INLINE 32
+
+typedef struct {
+  const json_t **items;
+  size_t depth;
+  size_t size;
+  const json_t *inline_items[PARENTS_INLINE];
+} parents_t;
+
+void jsonp_parents_init(parents_t *parents);
+void jsonp_parents_close(parents_t *parents);
+int jsonp_loop_check(parents_t *parents, const json_t *json);
+#define jsonp_loop_leave(parents) ((parents)->depth--)
+
+/* Free a tree made by json_freeze() */
+void jsonp_frozen_free(json_t *json);
+
+/* Template building, called by json_template_vcompile() as it reads
+   the format. All return -1 only when out of memory. */
+json_template_t *jsonp_template_new(size_t flags);
+int jsonp_template_open(json_template_t *tpl, char bracket);
+int jsonp_template_key(json_template_t *tpl, const char *key, size_t len);
+int jsonp_template_slot(json_template_t *tpl, char type, size_t offset,
+                        int nullable);
+int jsonp_template_close(json_template_t *tpl);
+int jsonp_template_end(json_template_t *tpl);
 
 /* Windows compatibility */
 #if defined(_WIN32) || defined(WIN32)
@@ -20,6 +20,12 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "jansson.h"
 #include "strbuffer.h"
@@ -65,13 +71,16 @@ typedef struct {
 typedef struct {
   stream_t stream;
   strbuffer_t saved_text;
+  jsonp_mapping_t *mapping; /* the stream reads from it */
   size_t flags;
   size_t depth;
+  size_t shape; /* of the container being parsed, see shape_hint() */
   int token;
   union {
     struct {
       char *val;
       size_t len;
+      int mapped; /* val points into lex->mapping */
     } string;
     json_int_t integer;
     double real;
@@ -275,9 +284,11 @@ static void lex_save_cached(lex_t *lex) {
 }
 
 static void lex_free_string(lex_t *lex) {
-  jsonp_free(lex->value.string.val);
+  if (!lex->value.string.mapped)
+    jsonp_free(lex->value.string.val);
   lex->value.string.val = NULL;
   lex->value.string.len = 0;
+  lex->value.string.mapped = 0;
 }
 
 /* assumes that str points to 'u' plus at least 4 valid hex digits */
@@ -307,9 +318,10 @@ static void lex_scan_string(lex_t *lex, json_error_t *error) {
   int c;
   const char *p;
   char *t;
-  int i;
+  int i, escaped = 0;
 
   lex->value.string.val = NULL;
+  lex->value.string.mapped = 0;
   lex->token = TOKEN_INVALID;
 
   c = lex_get_save(lex, error);
@@ -336,6 +348,7 @@ static void lex_scan_string(lex_t *lex, json_error_t *error) {
     }
 
     else if (c == '\\') {
+      escaped = 1;
       c = lex_get_save(lex, error);
       if (c == 'u') {
         c = lex_get_save(lex, error);
@@ -364,6 +377,20 @@ static void lex_scan_string(lex_t *lex, json_error_t *error) {
        - two \uXXXX escapes (length 12) forming an UTF-16 surrogate pair
          are converted to 4 bytes
   */
+  if (lex->mapping && !escaped) {
+    /* the value is the source text, terminated in place of the
+       closing quote */
+    char *end = lex->mapping->base + lex->stream.position - 1;
+
+    assert(*end == '"');
+    *end = '\0';
+    lex->value.string.len = lex->saved_text.length - 2;
+    lex->value.string.val = end - lex->value.string.len;
+    lex->value.string.mapped = 1;
+    lex->token = TOKEN_STRING;
+    return;
+  }
+
   t = jsonp_malloc(lex->saved_text.length + 1);
   if (!t) {
     /* this is not very nice, since TOKEN_INVALID is returned */
@@ -640,20 +667,29 @@ out:
 static char *lex_steal_string(lex_t *lex, size_t *out_len) {
   char *result = NULL;
   if (lex->token == TOKEN_STRING) {
-    result = lex->value.string.val;
+    if (lex->value.string.mapped)
+      result = jsonp_strndup(lex->value.string.val, lex->value.string.len);
+    else
+      result = lex->value.string.val;
     *out_len = lex->value.string.len;
     lex->value.string.val = NULL;
     lex->value.string.len = 0;
+    lex->value.string.mapped = 0;
   }
   return result;
 }
 
 static int lex_init(lex_t *lex, get_func get, size_t flags, void *data) {
   stream_init(&lex->stream, get, data);
-  if (strbuffer_init(&lex->saved_text))
+  if (strbuffer_init_pooled(&lex->saved_text))
     return -1;
 
+  lex->mapping = NULL;
+  lex->value.string.val = NULL;
+  lex->value.string.len = 0;
+  lex->value.string.mapped = 0;
   lex->flags = flags;
+  lex->shape = 0;
   lex->token = TOKEN_INVALID;
   return 0;
 }
@@ -661,7 +697,88 @@ static int lex_init(lex_t *lex, get_func get, size_t flags, void *data) {
 static void lex_close(lex_t *lex) {
   if (lex->token == TOKEN_STRING)
     lex_free_string(lex);
-  strbuffer_close(&lex->saved_text);
+  strbuffer_close_pooled(&lex->saved_text);
+}
+
+/*** capacity hints ***/
+
+/* The parser remembers how large containers were, keyed by their
+   shape: a hash of the keys leading to them from the root, with array
+   elements sharing one shape. The next document of the same layout
+   then allocates its objects and arrays at the right size up front.
+   When the caller passes the input length, the root shape comes from
+   it, so documents of very different sizes don't share hints. Loaders
+   that stream their input, json_loads() among them, don't measure it
+   and share one root shape. A hint is the smaller of the last two
+   sizes seen, capped at SHAPE_HINT_MAX, so one odd document can't make
+   later ones over-allocate. Hints are per thread and a mismatch only
+   costs some memory. */
+
+#define SHAPE_HINTS 256
+#define SHAPE_HINT_MAX 512
+#define SHAPE_MIX 0x9E3779B97F4A7C15ULL
+
+typedef struct {
+  size_t shape;
+  size_t size;
+  size_t previous;
+} shape_hint_t;
+
+static JSON_THREAD_LOCAL shape_hint_t shape_hints[SHAPE_HINTS];
+
+static size_t shape_of_key(size_t parent, const char *key, size_t len) {
+  /* the first and last 8 bytes of the key are enough to tell keys of
+     one document apart */
+  uint64_t head = 0, tail = 0, h;
+
+  memcpy(&head, key, len < 8 ? len : 8);
+  if (len > 8)
+    memcpy(&tail, key + len - 8, 8);
+
+  h = ((uint64_t)parent ^ head ^ ((uint64_t)len << 56)) * SHAPE_MIX;
+  h = ((h ^ (h >> 32)) ^ tail) * SHAPE_MIX;
+  return (size_t)(h ^ (h >> 29));
+}
+
+static size_t shape_of_element(size_t parent) {
+  uint64_t h = ((uint64_t)parent + 1) * SHAPE_MIX;
+  return (size_t)(h ^ (h >> 29));
+}
+
+/* Documents within a factor of two in length share a root shape */
+static size_t shape_of_input(size_t len) {
+  uint64_t bits = 0, h;
+
+  while (len) {
+    bits++;
+    len >>= 1;
+  }
+
+  h = ((bits << 32) | 0x5ea1) * SHAPE_MIX;
+  return (size_t)(h ^ (h >> 29));
+}
+
+static size_t shape_hint(size_t shape) {
+  shape_hint_t *hint = &shape_hints[(shape >> 7) % SHAPE_HINTS];
+  size_t size;
+
+  if (hint->shape != shape)
+    return 0;
+
+  size = hint->size < hint->previous ? hint->size : hint->previous;
+  return size < SHAPE_HINT_MAX ? size : SHAPE_HINT_MAX;
+}
+
+static void shape_learn(size_t shape, size_t size) {
+  shape_hint_t *hint = &shape_hints[(shape >> 7) % SHAPE_HINTS];
+
+  if (hint->shape == shape) {
+    hint->previous = hint->size;
+  } else {
+    hint->shape = shape;
+    hint->previous = 0;
+  }
+  hint->size = size;
 }
 
 /*** parser ***/
@@ -669,17 +786,20 @@ static void lex_close(lex_t *lex) {
 static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error);
 
 static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error) {
-  json_t *object = json_object();
+  size_t shape = lex->shape, hint = shape_hint(shape);
+  json_t *object = hint ? json_object_with_capacity(hint) : json_object();
   if (!object)
     return NULL;
 
   lex_scan(lex, error);
-  if (lex->token == '}')
+  if (lex->token == '}') {
+    shape_learn(shape, 0);
     return object;
+  }
 
   while (1) {
     char *key;
-    size_t len;
+    size_t len, hash;
     json_t *value;
 
     if (lex->token != TOKEN_STRING) {
@@ -698,8 +818,10 @@ static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error) {
       goto error;
     }
 
+    /* hashed once for the duplicate check and the insertion */
+    hash = jsonp_object_hash(object, key, len);
     if (flags & JSON_REJECT_DUPLICATES) {
-      if (json_object_getn(object, key, len)) {
+      if (jsonp_object_getn_hashed(object, key, len, hash)) {
         jsonp_free(key);
         error_set(error, lex, json_error_duplicate_key, "duplicate object key");
         goto error;
@@ -714,13 +836,16 @@ static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error) {
     }
 
     lex_scan(lex, error);
+    if (lex->token == '{' || lex->token == '[')
+      lex->shape = shape_of_key(shape, key, len);
     value = parse_value(lex, flags, error);
+    lex->shape = shape;
     if (!value) {
       jsonp_free(key);
       goto error;
     }
 
-    if (json_object_setn_new_nocheck(object, key, len, value)) {
+    if (jsonp_object_setn_new_hashed(object, key, len, hash, value)) {
       jsonp_free(key);
       goto error;
     }
@@ -739,6 +864,7 @@ static json_t *parse_object(lex_t *lex, size_t flags, json_error_t *error) {
     goto error;
   }
 
+  shape_learn(shape, json_object_size(object));
   return object;
 
 error:
@@ -747,21 +873,33 @@ error:
 }
 
 static json_t *parse_array(lex_t *lex, size_t flags, json_error_t *error) {
-  json_t *array = json_array();
+  size_t shape = lex->shape, hint = shape_hint(shape);
+  json_t *array = hint > 8 ? json_array_with_capacity(hint) : json_array();
   if (!array)
     return NULL;
 
   lex_scan(lex, error);
-  if (lex->token == ']')
+  if (lex->token == ']') {
+    shape_learn(shape, 0);
     return array;
+  }
 
+  lex->shape = shape_of_element(shape);
   while (lex->token) {
-    json_t *elem = parse_value(lex, flags, error);
-    if (!elem)
-      goto error;
+    if ((flags & JSON_PACKED_ARRAYS) && lex->token == TOKEN_REAL) {
+      if (jsonp_array_append_real(array, lex->value.real))
+        goto error;
+    } else if ((flags & JSON_PACKED_ARRAYS) && lex->token == TOKEN_INTEGER) {
+      if (jsonp_array_append_integer(array, lex->value.integer))
+        goto error;
+    } else {
+      json_t *elem = parse_value(lex, flags, error);
+      if (!elem)
+        goto error;
 
-    if (json_array_append_new(array, elem)) {
-      goto error;
+      if (json_array_append_new(array, elem)) {
+        goto error;
+      }
     }
 
     lex_scan(lex, error);
@@ -771,11 +909,14 @@ static json_t *parse_array(lex_t *lex, size_t flags, json_error_t *error) {
     lex_scan(lex, error);
   }
 
+  lex->shape = shape;
+
   if (lex->token != ']') {
     error_set(error, lex, json_error_invalid_syntax, "']' expected");
     goto error;
   }
 
+  shape_learn(shape, json_array_size(array));
   return array;
 
 error:
@@ -806,7 +947,11 @@ static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error) {
       }
     }
 
-    json = jsonp_stringn_nocheck_own(value, len);
+    if (lex->value.string.mapped) {
+      json = jsonp_stringn_nocheck_mapped(value, len, lex->mapping);
+      lex->value.string.mapped = 0;
+    } else
+      json = jsonp_stringn_nocheck_own(value, len);
     lex->value.string.val = NULL;
     lex->value.string.len = 0;
     break;
@@ -854,6 +999,9 @@ static json_t *parse_value(lex_t *lex, size_t flags, json_error_t *error) {
   if (!json)
     return NULL;
 
+  if ((flags & JSON_DECODE_CONFINED) && json->refcount != (size_t)-1)
+    json->flags |= JSON_VALUE_CONFINED;
+
   lex->depth--;
   return json;
 }
@@ -893,6 +1041,227 @@ static json_t *parse_json(lex_t *lex, size_t flags, json_error_t *error) {
   return result;
 }
 
+/*** event parser ***/
+
+/* Same grammar as parse_value() and friends, but values are handed to
+   the handlers straight from the lexer instead of being built into a
+   tree. Returns 0 on success, -1 on error and SAX_STOPPED if a handler
+   returned nonzero. Duplicate keys are passed through, there is no
+   object to check JSON_REJECT_DUPLICATES against. */
+
+#define SAX_STOPPED 1
+
+typedef struct {
+  const json_sax_handlers_t *handlers;
+  void *data;
+} sax_t;
+
+#define sax_emit(sax, event)                                                   \
+  ((sax)->handlers->event && (sax)->handlers->event((sax)->data))
+#define sax_emit_value(sax, event, ...)                                        \
+  ((sax)->handlers->event && (sax)->handlers->event((sax)->data, __VA_ARGS__))
+
+static int sax_value(lex_t *lex, const sax_t *sax, size_t flags,
+                     json_error_t *error);
+
+static int sax_object(lex_t *lex, const sax_t *sax, size_t flags,
+                      json_error_t *error) {
+  int result;
+
+  if (sax_emit(sax, start_object))
+    return SAX_STOPPED;
+
+  lex_scan(lex, error);
+  if (lex->token == '}')
+    return sax_emit(sax, end_object) ? SAX_STOPPED : 0;
+
+  while (1) {
+    if (lex->token != TOKEN_STRING) {
+      error_set(error, lex, json_error_invalid_syntax,
+                "string or '}' expected");
+      return -1;
+    }
+
+    if (memchr(lex->value.string.val, '\0', lex->value.string.len)) {
+      error_set(error, lex, json_error_null_byte_in_key,
+                "NUL byte in object key not supported");
+      return -1;
+    }
+
+    if (sax_emit_value(sax, key, lex->value.string.val, lex->value.string.len))
+      return SAX_STOPPED;
+
+    lex_scan(lex, error);
+    if (lex->token != ':') {
+      error_set(error, lex, json_error_invalid_syntax, "':' expected");
+      return -1;
+    }
+
+    lex_scan(lex, error);
+    result = sax_value(lex, sax, flags, error);
+    if (result)
+      return result;
+
+    lex_scan(lex, error);
+    if (lex->token != ',')
+      break;
+
+    lex_scan(lex, error);
+  }
+
+  if (lex->token != '}') {
+    error_set(error, lex, json_error_invalid_syntax, "'}' expected");
+    return -1;
+  }
+
+  return sax_emit(sax, end_object) ? SAX_STOPPED : 0;
+}
+
+static int sax_array(lex_t *lex, const sax_t *sax, size_t flags,
+                     json_error_t *error) {
+  int result;
+
+  if (sax_emit(sax, start_array))
+    return SAX_STOPPED;
+
+  lex_scan(lex, error);
+  if (lex->token == ']')
+    return sax_emit(sax, end_array) ? SAX_STOPPED : 0;
+
+  while (lex->token) {
+    result = sax_value(lex, sax, flags, error);
+    if (result)
+      return result;
+
+    lex_scan(lex, error);
+    if (lex->token != ',')
+      break;
+
+    lex_scan(lex, error);
+  }
+
+  if (lex->token != ']') {
+    error_set(error, lex, json_error_invalid_syntax, "']' expected");
+    return -1;
+  }
+
+  return sax_emit(sax, end_array) ? SAX_STOPPED : 0;
+}
+
+static int sax_value(lex_t *lex, const sax_t *sax, size_t flags,
+                     json_error_t *error) {
+  int result;
+
+  lex->depth++;
+  if (lex->depth > JSON_PARSER_MAX_DEPTH) {
+    error_set(error, lex, json_error_stack_overflow,
+              "maximum parsing depth reached");
+    return -1;
+  }
+
+  switch (lex->token) {
+  case TOKEN_STRING: {
+    const char *value = lex->value.string.val;
+    size_t len = lex->value.string.len;
+
+    if (!(flags & JSON_ALLOW_NUL)) {
+      if (memchr(value, '\0', len)) {
+        error_set(error, lex, json_error_null_character,
+                  "\\u0000 is not allowed without JSON_ALLOW_NUL");
+        return -1;
+      }
+    }
+
+    result = sax_emit_value(sax, string, value, len);
+    break;
+  }
+
+  case TOKEN_INTEGER:
+    result = sax_emit_value(sax, integer, lex->value.integer);
+    break;
+
+  case TOKEN_REAL:
+    result = sax_emit_value(sax, real, lex->value.real);
+    break;
+
+  case TOKEN_TRUE:
+    result = sax_emit_value(sax, boolean, 1);
+    break;
+
+  case TOKEN_FALSE:
+    result = sax_emit_value(sax, boolean, 0);
+    break;
+
+  case TOKEN_NULL:
+    result = sax_emit(sax, null);
+    break;
+
+  case '{':
+    result = sax_object(lex, sax, flags, error);
+    if (result)
+      return result;
+    break;
+
+  case '[':
+    result = sax_array(lex, sax, flags, error);
+    if (result)
+      return result;
+    break;
+
+  case TOKEN_INVALID:
+    error_set(error, lex, json_error_invalid_syntax, "invalid token");
+    return -1;
+
+  default:
+    error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+    return -1;
+  }
+
+  if (result)
+    return SAX_STOPPED;
+
+  lex->depth--;
+  return 0;
+}
+
+static int sax_json(lex_t *lex, const json_sax_handlers_t *handlers,
+                    void *data, size_t flags, json_error_t *error) {
+  sax_t sax;
+  int result;
+
+  sax.handlers = handlers;
+  sax.data = data;
+  lex->depth = 0;
+
+  lex_scan(lex, error);
+  if (!(flags & JSON_DECODE_ANY)) {
+    if (lex->token != '[' && lex->token != '{') {
+      error_set(error, lex, json_error_invalid_syntax, "'[' or '{' expected");
+      return -1;
+    }
+  }
+
+  result = sax_value(lex, &sax, flags, error);
+  if (result < 0)
+    return -1;
+
+  if (!result && !(flags & JSON_DISABLE_EOF_CHECK)) {
+    lex_scan(lex, error);
+    if (lex->token != TOKEN_EOF) {
+      error_set(error, lex, json_error_end_of_input_expected,
+                "end of file expected");
+      return -1;
+    }
+  }
+
+  if (error) {
+    /* Save the position even though there was no error */
+    error->position = (int)lex->stream.position;
+  }
+
+  return result;
+}
+
 typedef struct {
   const char *data;
   size_t pos;
@@ -971,131 +1340,1711 @@ json_t *json_loadb(const char *buffer, size_t buflen, size_t flags,
   if (lex_init(&lex, buffer_get, flags, (void *)&stream_data))
     return NULL;
 
+  lex.shape = shape_of_input(buflen);
   result = parse_json(&lex, flags, error);
 
   lex_close(&lex);
   return result;
 }
 
-json_t *json_loadf(FILE *input, size_t flags, json_error_t *error) {
-  lex_t lex;
-  const char *source;
-  json_t *result;
-
-  if (input == stdin)
-    source = "<stdin>";
-  else
-    source = "<stream>";
+/*** selective parser ***/
 
-  jsonp_error_init(error, source);
+/* json_loadb_select() builds only the parts of a document that some
+   JSON Pointer in the selection reaches. Everything else is stepped
+   over by skip_value(), which works on the raw buffer: it only
+   balances brackets and finds the end of strings, so no token is
+   decoded or allocated for skipped values, and syntax errors inside
+   them go unnoticed. JSON_REJECT_DUPLICATES only applies to selected
+   keys. */
 
-  if (input == NULL) {
-    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
-    return NULL;
+typedef struct select_node {
+  char *key; /* unescaped reference token */
+  size_t len;
+  size_t index; /* key as an array index, or (size_t)-1 */
+  int whole;    /* the entire value is selected */
+  struct select_node *children;
+  size_t count;
+  size_t size;
+} select_node_t;
+
+#define SKIP_VALUE 0
+#define SKIP_EMPTY 1 /* the container ended instead */
+
+static void select_close(select_node_t *node) {
+  size_t i;
+
+  for (i = 0; i < node->count; i++) {
+    select_close(&node->children[i]);
+    jsonp_free(node->children[i].key);
   }
+  jsonp_free(node->children);
+  node->children = NULL;
+  node->count = node->size = 0;
+}
 
-  if (lex_init(&lex, (get_func)fgetc, flags, input))
-    return NULL;
+static size_t select_index(const char *key, size_t len) {
+  size_t i, index = 0;
 
-  result = parse_json(&lex, flags, error);
+  if (len == 0 || (len > 1 && key[0] == '0'))
+    return (size_t)-1;
 
-  lex_close(&lex);
-  return result;
-}
+  for (i = 0; i < len; i++) {
+    if (!l_isdigit(key[i]) || index > ((size_t)-1 - 9) / 10)
+      return (size_t)-1;
+    index = index * 10 + (size_t)(key[i] - '0');
+  }
 
-static int fd_get_func(int *fd) {
-#ifdef HAVE_UNISTD_H
-  uint8_t c;
-  if (read(*fd, &c, 1) == 1)
-    return c;
-#endif
-  /* note Jimmy Suppress unused parameter warnings */
-  (void)fd;
-  return EOF;
+  return index;
 }
 
-json_t *json_loadfd(int input, size_t flags, json_error_t *error) {
-  lex_t lex;
-  const char *source;
-  json_t *result;
+static select_node_t *select_child(select_node_t *node, const char *key,
+                                   size_t len) {
+  size_t i;
 
-#ifdef HAVE_UNISTD_H
-  if (input == STDIN_FILENO)
-    source = "<stdin>";
-  else
-#endif
-    source = "<stream>";
+  for (i = 0; i < node->count; i++) {
+    select_node_t *child = &node->children[i];
+    if (child->len == len && memcmp(child->key, key, len) == 0)
+      return child;
+  }
+  return NULL;
+}
 
-  jsonp_error_init(error, source);
+static select_node_t *select_child_index(select_node_t *node, size_t index) {
+  size_t i;
 
-  if (input < 0) {
-    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
-    return NULL;
+  for (i = 0; i < node->count; i++) {
+    if (node->children[i].index == index)
+      return &node->children[i];
   }
+  return NULL;
+}
+
+static select_node_t *select_add_child(select_node_t *node, char *key,
+                                       size_t len) {
+  select_node_t *child;
+
+  if (node->count == node->size) {
+    size_t new_size = node->size ? node->size * 2 : 4;
+    select_node_t *children =
+        jsonp_malloc(new_size * sizeof(select_node_t));
+    if (!children)
+      return NULL;
+
+    if (node->count)
+      memcpy(children, node->children, node->count * sizeof(select_node_t));
+    jsonp_free(node->children);
+    node->children = children;
+    node->size = new_size;
+  }
+
+  child = &node->children[node->count++];
+  memset(child, 0, sizeof(select_node_t));
+  child->key = key;
+  child->len = len;
+  child->index = select_index(key, len);
+  return child;
+}
+
+/* Add one RFC 6901 pointer to the selection. Returns -1 if the
+   pointer is malformed or on allocation failure. */
+static int select_add(select_node_t *root, const char *pointer) {
+  select_node_t *node = root;
+  const char *p = pointer;
+
+  if (*p != '\0' && *p != '/')
+    return -1;
+
+  while (*p && !node->whole) {
+    const char *end = strchr(p + 1, '/');
+    size_t i, len = 0, token_len;
+    select_node_t *child;
+    char *key;
+
+    if (!end)
+      end = p + strlen(p);
+
+    token_len = (size_t)(end - p - 1);
+    key = jsonp_malloc(token_len + 1);
+    if (!key)
+      return -1;
+
+    for (i = 1; p + i < end; i++) {
+      if (p[i] == '~') {
+        if (p[i + 1] == '0')
+          key[len++] = '~';
+        else if (p[i + 1] == '1')
+          key[len++] = '/';
+        else {
+          jsonp_free(key);
+          return -1;
+        }
+        i++;
+      } else
+        key[len++] = p[i];
+    }
+    key[len] = '\0';
+
+    child = select_child(node, key, len);
+    if (child)
+      jsonp_free(key);
+    else {
+      child = select_add_child(node, key, len);
+      if (!child) {
+        jsonp_free(key);
+        return -1;
+      }
+    }
+
+    node = child;
+    p = end;
+  }
+
+  if (!node->whole) {
+    node->whole = 1;
+    select_close(node);
+  }
+  return 0;
+}
+
+static void skip_advance(stream_t *stream, const char *p, const char *end) {
+  /* same bookkeeping as stream_get() */
+  for (; p < end; p++) {
+    stream->position++;
+    if (*p == '\n') {
+      stream->line++;
+      stream->last_column = stream->column;
+      stream->column = 0;
+    } else if (utf8_check_first(*p))
+      stream->column++;
+  }
+}
+
+/* Step over the value starting at the current input position. Must
+   only be called right after a ':', '[' or ',' token, when the
+   stream holds no buffered bytes. */
+static int skip_value(lex_t *lex, json_error_t *error) {
+  stream_t *stream = &lex->stream;
+  buffer_data_t *input = stream->data;
+  const char *start = input->data + input->pos;
+  const char *end = input->data + input->len;
+  const char *p = start;
+  size_t depth = 0;
+  int result = SKIP_VALUE;
+  char c;
+
+  assert(!stream->buffer[stream->buffer_pos]);
+
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+    p++;
+
+  if (p == end)
+    goto eof;
+
+  if (*p == ']' || *p == '}') {
+    result = SKIP_EMPTY;
+    goto out;
+  }
+
+  while (p < end) {
+    c = *p++;
+
+    switch (c) {
+    case '"':
+      while (p < end && *p != '"')
+        p += *p == '\\' ? 2 : 1;
+      if (p >= end)
+        goto eof;
+      p++;
+      break;
+
+    case '{':
+    case '[':
+      depth++;
+      break;
+
+    case '}':
+    case ']':
+      if (depth == 0) {
+        /* closes the enclosing container, left to the lexer */
+        p--;
+        goto out;
+      }
+      depth--;
+      break;
+
+    case ',':
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      if (depth == 0) {
+        p--;
+        goto out;
+      }
+      break;
+    }
+
+    if (depth == 0 && (c == '"' || c == '}' || c == ']'))
+      goto out;
+  }
+
+  if (depth > 0)
+    goto eof;
+
+out:
+  skip_advance(stream, start, p);
+  input->pos = (size_t)(p - input->data);
+  return result;
+
+eof:
+  skip_advance(stream, start, end);
+  input->pos = input->len;
+  strbuffer_clear(&lex->saved_text);
+  error_set(error, lex, json_error_premature_end_of_input,
+            "premature end of input");
+  return -1;
+}
+
+static int select_value(lex_t *lex, select_node_t *node, size_t flags,
+                        json_error_t *error, json_t **result);
+
+/* Partially selected containers that matched nothing are left out */
+static int select_keep(select_node_t *node, json_t *value) {
+  if (node->whole)
+    return 1;
+  if (json_is_object(value))
+    return json_object_size(value) > 0;
+  return json_array_size(value) > 0;
+}
+
+static json_t *select_object(lex_t *lex, select_node_t *node,
+                             size_t flags, json_error_t *error) {
+  json_t *object = json_object();
+  if (!object)
+    return NULL;
+
+  lex_scan(lex, error);
+  if (lex->token == '}')
+    return object;
+
+  while (1) {
+    select_node_t *child;
+    char *key;
+    size_t len, hash;
+    json_t *value;
+
+    if (lex->token != TOKEN_STRING) {
+      error_set(error, lex, json_error_invalid_syntax,
+                "string or '}' expected");
+      goto error;
+    }
+
+    if (memchr(lex->value.string.val, '\0', lex->value.string.len)) {
+      error_set(error, lex, json_error_null_byte_in_key,
+                "NUL byte in object key not supported");
+      goto error;
+    }
+
+    child = select_child(node, lex->value.string.val,
+                         lex->value.string.len);
+    key = child ? lex_steal_string(lex, &len) : NULL;
+
+    lex_scan(lex, error);
+    if (lex->token != ':') {
+      jsonp_free(key);
+      error_set(error, lex, json_error_invalid_syntax, "':' expected");
+      goto error;
+    }
+
+    if (!child) {
+      int skipped = skip_value(lex, error);
+      if (skipped < 0)
+        goto error;
+
+      if (skipped == SKIP_EMPTY) {
+        lex_scan(lex, error);
+        error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+        goto error;
+      }
+    } else {
+      lex_scan(lex, error);
+      if (select_value(lex, child, flags, error, &value)) {
+        jsonp_free(key);
+        goto error;
+      }
+
+      if (value && !select_keep(child, value)) {
+        json_decref(value);
+        value = NULL;
+      }
+
+      hash = value ? jsonp_object_hash(object, key, len) : 0;
+      if (value && (flags & JSON_REJECT_DUPLICATES) &&
+          jsonp_object_getn_hashed(object, key, len, hash)) {
+        json_decref(value);
+        jsonp_free(key);
+        error_set(error, lex, json_error_duplicate_key, "duplicate object key");
+        goto error;
+      }
+
+      if (value && jsonp_object_setn_new_hashed(object, key, len, hash, value)) {
+        jsonp_free(key);
+        goto error;
+      }
+
+      jsonp_free(key);
+    }
+
+    lex_scan(lex, error);
+    if (lex->token != ',')
+      break;
+
+    lex_scan(lex, error);
+  }
+
+  if (lex->token != '}') {
+    error_set(error, lex, json_error_invalid_syntax, "'}' expected");
+    goto error;
+  }
+
+  return object;
+
+error:
+  json_decref(object);
+  return NULL;
+}
+
+static json_t *select_array(lex_t *lex, select_node_t *node,
+                            size_t flags, json_error_t *error) {
+  size_t index = 0;
+  json_t *array = json_array();
+  if (!array)
+    return NULL;
+
+  while (1) {
+    select_node_t *child = select_child_index(node, index);
+    json_t *value;
+
+    if (!child) {
+      int skipped = skip_value(lex, error);
+      if (skipped < 0)
+        goto error;
+
+      lex_scan(lex, error);
+      if (skipped == SKIP_EMPTY) {
+        if (index == 0 && lex->token == ']')
+          return array;
+
+        error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+        goto error;
+      }
+    } else {
+      lex_scan(lex, error);
+      if (index == 0 && lex->token == ']')
+        return array;
+
+      if (select_value(lex, child, flags, error, &value))
+        goto error;
+
+      if (value && select_keep(child, value)) {
+        while (json_array_size(array) < index) {
+          if (json_array_append_new(array, json_null())) {
+            json_decref(value);
+            goto error;
+          }
+        }
+        if (json_array_append_new(array, value))
+          goto error;
+      } else
+        json_decref(value);
+
+      lex_scan(lex, error);
+    }
+
+    if (lex->token != ',')
+      break;
+
+    index++;
+  }
+
+  if (lex->token != ']') {
+    error_set(error, lex, json_error_invalid_syntax, "']' expected");
+    goto error;
+  }
+
+  return array;
+
+error:
+  json_decref(array);
+  return NULL;
+}
+
+/* Returns -1 on error. Otherwise *result is the selected part of the
+   value, or NULL if a pointer led into a scalar. */
+static int select_value(lex_t *lex, select_node_t *node, size_t flags,
+                        json_error_t *error, json_t **result) {
+  *result = NULL;
+
+  if (node->whole) {
+    *result = parse_value(lex, flags, error);
+    return *result ? 0 : -1;
+  }
+
+  lex->depth++;
+  if (lex->depth > JSON_PARSER_MAX_DEPTH) {
+    error_set(error, lex, json_error_stack_overflow,
+              "maximum parsing depth reached");
+    return -1;
+  }
+
+  switch (lex->token) {
+  case '{':
+    *result = select_object(lex, node, flags, error);
+    if (!*result)
+      return -1;
+    break;
+
+  case '[':
+    *result = select_array(lex, node, flags, error);
+    if (!*result)
+      return -1;
+    break;
+
+  case TOKEN_STRING:
+  case TOKEN_INTEGER:
+  case TOKEN_REAL:
+  case TOKEN_TRUE:
+  case TOKEN_FALSE:
+  case TOKEN_NULL:
+    break;
+
+  case TOKEN_INVALID:
+    error_set(error, lex, json_error_invalid_syntax, "invalid token");
+    return -1;
+
+  default:
+    error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+    return -1;
+  }
+
+  lex->depth--;
+  return 0;
+}
+
+static json_t *select_json(lex_t *lex, select_node_t *root,
+                           size_t flags, json_error_t *error) {
+  json_t *result;
+
+  lex->depth = 0;
+
+  lex_scan(lex, error);
+  if (!(flags & JSON_DECODE_ANY)) {
+    if (lex->token != '[' && lex->token != '{') {
+      error_set(error, lex, json_error_invalid_syntax, "'[' or '{' expected");
+      return NULL;
+    }
+  }
+
+  if (select_value(lex, root, flags, error, &result))
+    return NULL;
+
+  if (!result) {
+    error_set(error, lex, json_error_item_not_found,
+              "no value selected from a scalar");
+    return NULL;
+  }
+
+  if (!(flags & JSON_DISABLE_EOF_CHECK)) {
+    lex_scan(lex, error);
+    if (lex->token != TOKEN_EOF) {
+      error_set(error, lex, json_error_end_of_input_expected,
+                "end of file expected");
+      json_decref(result);
+      return NULL;
+    }
+  }
+
+  if (error) {
+    /* Save the position even though there was no error */
+    error->position = (int)lex->stream.position;
+  }
+
+  return result;
+}
+
+json_t *json_loadb_select(const char *buffer, size_t buflen,
+                          const char *const *paths, size_t npaths, size_t flags,
+                          json_error_t *error) {
+  lex_t lex;
+  json_t *result = NULL;
+  buffer_data_t stream_data;
+  select_node_t root;
+  size_t i;
+
+  jsonp_error_init(error, "<buffer>");
+
+  if (buffer == NULL || (paths == NULL && npaths > 0)) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return NULL;
+  }
+
+  memset(&root, 0, sizeof(root));
+  root.index = (size_t)-1;
+
+  for (i = 0; i < npaths; i++) {
+    if (!paths[i] || select_add(&root, paths[i])) {
+      error_set(error, NULL, json_error_invalid_argument,
+                "invalid JSON pointer at index %d", (int)i);
+      goto out;
+    }
+  }
+
+  stream_data.data = buffer;
+  stream_data.pos = 0;
+  stream_data.len = buflen;
+
+  if (lex_init(&lex, buffer_get, flags, (void *)&stream_data))
+    goto out;
+
+  lex.shape = shape_of_input(buflen);
+  result = select_json(&lex, &root, flags, error);
+
+  lex_close(&lex);
+
+out:
+  select_close(&root);
+  return result;
+}
+
+/* Struct binding works on the tokens directly, like the selection
+   above, and skips the raw bytes of values no field asks for */
+
+static const json_field_t *bind_field(const json_field_t *fields,
+                                      const char *key, size_t len) {
+  for (; fields->key; fields++) {
+    if (strlen(fields->key) == len && memcmp(fields->key, key, len) == 0)
+      return fields;
+  }
+  return NULL;
+}
+
+static int bind_object(lex_t *lex, const json_field_t *fields, char *data,
+                       size_t flags, json_error_t *error);
+
+static int bind_value(lex_t *lex, const json_field_t *field, char *data,
+                      size_t flags, json_error_t *error) {
+  char *member = data + field->offset;
+
+  switch (lex->token) {
+  case TOKEN_NULL:
+    return 0;
+
+  case TOKEN_INTEGER: {
+    json_int_t value = lex->value.integer;
+
+    if (field->type == JSON_FIELD_INTEGER) {
+      memcpy(member, &value, sizeof(value));
+      return 0;
+    }
+    if (field->type == JSON_FIELD_REAL) {
+      double real = (double)value;
+      memcpy(member, &real, sizeof(real));
+      return 0;
+    }
+    if (field->type == JSON_FIELD_INT) {
+      int integer = (int)value;
+
+      if (integer != value) {
+        error_set(error, lex, json_error_numeric_overflow,
+                  "too big integer for '%s'", field->key);
+        return -1;
+      }
+      memcpy(member, &integer, sizeof(integer));
+      return 0;
+    }
+    break;
+  }
+
+  case TOKEN_REAL:
+    if (field->type == JSON_FIELD_REAL) {
+      memcpy(member, &lex->value.real, sizeof(double));
+      return 0;
+    }
+    break;
+
+  case TOKEN_TRUE:
+  case TOKEN_FALSE:
+    if (field->type == JSON_FIELD_BOOLEAN) {
+      int value = lex->token == TOKEN_TRUE;
+      memcpy(member, &value, sizeof(value));
+      return 0;
+    }
+    break;
+
+  case TOKEN_STRING: {
+    const char *value = lex->value.string.val;
+    size_t len = lex->value.string.len;
+
+    if (field->type != JSON_FIELD_STRING && field->type != JSON_FIELD_CHARS)
+      break;
+
+    if (memchr(value, '\0', len)) {
+      error_set(error, lex, json_error_null_character,
+                "\\u0000 is not allowed in '%s'", field->key);
+      return -1;
+    }
+
+    if (field->type == JSON_FIELD_CHARS) {
+      if (len >= field->size) {
+        error_set(error, lex, json_error_index_out_of_range,
+                  "too long string for '%s'", field->key);
+        return -1;
+      }
+      memcpy(member, value, len + 1);
+    } else {
+      char *str;
+
+      memcpy(&str, member, sizeof(str));
+      jsonp_free(str);
+      str = lex_steal_string(lex, &len);
+      memcpy(member, &str, sizeof(str));
+    }
+    return 0;
+  }
+
+  case '{': {
+    int res;
+
+    if (field->type != JSON_FIELD_OBJECT)
+      break;
+
+    lex->depth++;
+    if (lex->depth > JSON_PARSER_MAX_DEPTH) {
+      error_set(error, lex, json_error_stack_overflow,
+                "maximum parsing depth reached");
+      return -1;
+    }
+
+    res = bind_object(lex, field->fields, member, flags, error);
+    lex->depth--;
+    return res;
+  }
+
+  case TOKEN_INVALID:
+    error_set(error, lex, json_error_invalid_syntax, "invalid token");
+    return -1;
+
+  case '[':
+    break;
+
+  default:
+    error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+    return -1;
+  }
+
+  error_set(error, lex, json_error_wrong_type, "wrong type for '%s'",
+            field->key);
+  return -1;
+}
+
+static int bind_object(lex_t *lex, const json_field_t *fields, char *data,
+                       size_t flags, json_error_t *error) {
+  lex_scan(lex, error);
+  if (lex->token == '}')
+    return 0;
+
+  while (1) {
+    const json_field_t *field;
+
+    if (lex->token != TOKEN_STRING) {
+      error_set(error, lex, json_error_invalid_syntax,
+                "string or '}' expected");
+      return -1;
+    }
+
+    field = bind_field(fields, lex->value.string.val, lex->value.string.len);
+
+    lex_scan(lex, error);
+    if (lex->token != ':') {
+      error_set(error, lex, json_error_invalid_syntax, "':' expected");
+      return -1;
+    }
+
+    if (!field) {
+      int skipped = skip_value(lex, error);
+      if (skipped < 0)
+        return -1;
+
+      if (skipped == SKIP_EMPTY) {
+        lex_scan(lex, error);
+        error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+        return -1;
+      }
+    } else {
+      lex_scan(lex, error);
+      if (bind_value(lex, field, data, flags, error))
+        return -1;
+    }
+
+    lex_scan(lex, error);
+    if (lex->token != ',')
+      break;
+
+    lex_scan(lex, error);
+  }
+
+  if (lex->token != '}') {
+    error_set(error, lex, json_error_invalid_syntax, "'}' expected");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* The root is an object bound to data, or with items set an array of
+   up to max_items such objects */
+static int bind_json(lex_t *lex, const json_field_t *fields, char *data,
+                     char *items, size_t item_size, size_t max_items,
+                     size_t *count, size_t flags, json_error_t *error) {
+  lex->depth = 0;
+
+  lex_scan(lex, error);
+  if (!items) {
+    if (lex->token != '{') {
+      error_set(error, lex, json_error_invalid_syntax, "'{' expected");
+      return -1;
+    }
+
+    if (bind_object(lex, fields, data, flags, error))
+      return -1;
+  } else {
+    size_t n = 0;
+
+    if (lex->token != '[') {
+      error_set(error, lex, json_error_invalid_syntax, "'[' expected");
+      return -1;
+    }
+
+    lex_scan(lex, error);
+    while (lex->token != ']') {
+      if (lex->token != '{') {
+        error_set(error, lex, json_error_wrong_type, "'{' expected");
+        return -1;
+      }
+
+      if (n == max_items) {
+        error_set(error, lex, json_error_index_out_of_range,
+                  "more than %d array items", (int)max_items);
+        return -1;
+      }
+
+      lex->depth = 1;
+      if (bind_object(lex, fields, items + n * item_size, flags, error))
+        return -1;
+      *count = ++n;
+
+      lex_scan(lex, error);
+      if (lex->token != ',')
+        break;
+
+      /* no trailing comma */
+      lex_scan(lex, error);
+      if (lex->token == ']') {
+        error_set(error, lex, json_error_invalid_syntax, "'{' expected");
+        return -1;
+      }
+    }
+
+    if (lex->token != ']') {
+      error_set(error, lex, json_error_invalid_syntax, "']' expected");
+      return -1;
+    }
+  }
+
+  if (!(flags & JSON_DISABLE_EOF_CHECK)) {
+    lex_scan(lex, error);
+    if (lex->token != TOKEN_EOF) {
+      error_set(error, lex, json_error_end_of_input_expected,
+                "end of file expected");
+      return -1;
+    }
+  }
+
+  if (error) {
+    /* Save the position even though there was no error */
+    error->position = (int)lex->stream.position;
+  }
+
+  return 0;
+}
+
+static int bind_load(const char *buffer, size_t buflen,
+                     const json_field_t *fields, char *data, char *items,
+                     size_t item_size, size_t max_items, size_t *count,
+                     size_t flags, json_error_t *error) {
+  lex_t lex;
+  buffer_data_t stream_data;
+  int result;
+
+  jsonp_error_init(error, "<buffer>");
+
+  if (buffer == NULL || fields == NULL || (!data && !items)) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return -1;
+  }
+
+  stream_data.data = buffer;
+  stream_data.pos = 0;
+  stream_data.len = buflen;
+
+  if (lex_init(&lex, buffer_get, flags, (void *)&stream_data))
+    return -1;
+
+  result = bind_json(&lex, fields, data, items, item_size, max_items, count,
+                     flags, error);
+
+  lex_close(&lex);
+  return result;
+}
+
+int json_loadb_struct(const char *buffer, size_t buflen,
+                      const json_field_t *fields, void *data, size_t flags,
+                      json_error_t *error) {
+  return bind_load(buffer, buflen, fields, data, NULL, 0, 0, NULL, flags,
+                   error);
+}
+
+int json_loadb_struct_array(const char *buffer, size_t buflen,
+                            const json_field_t *fields, void *items,
+                            size_t item_size, size_t max_items, size_t *count,
+                            size_t flags, json_error_t *error) {
+  size_t n = 0;
+  int result;
+
+  if (!items) {
+    jsonp_error_init(error, "<buffer>");
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return -1;
+  }
+
+  result = bind_load(buffer, buflen, fields, NULL, items, item_size,
+                     max_items, &n, flags, error);
+  if (count)
+    *count = n;
+  return result;
+}
+
+json_t *json_loadf(FILE *input, size_t flags, json_error_t *error) {
+  lex_t lex;
+  const char *source;
+  json_t *result;
+
+  if (input == stdin)
+    source = "<stdin>";
+  else
+    source = "<stream>";
+
+  jsonp_error_init(error, source);
+
+  if (input == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return NULL;
+  }
+
+  if (lex_init(&lex, (get_func)fgetc, flags, input))
+    return NULL;
+
+  result = parse_json(&lex, flags, error);
+
+  lex_close(&lex);
+  return result;
+}
+
+static int fd_get_func(int *fd) {
+#ifdef HAVE_UNISTD_H
+  uint8_t c;
+  if (read(*fd, &c, 1) == 1)
+    return c;
+#endif
+  /* note Jimmy Suppress unused parameter warnings */
+  (void)fd;
+  return EOF;
+}
+
+json_t *json_loadfd(int input, size_t flags, json_error_t *error) {
+  lex_t lex;
+  const char *source;
+  json_t *result;
+
+#ifdef HAVE_UNISTD_H
+  if (input == STDIN_FILENO)
+    source = "<stdin>";
+  else
+#endif
+    source = "<stream>";
+
+  jsonp_error_init(error, source);
+
+  if (input < 0) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return NULL;
+  }
+
+  if (lex_init(&lex, (get_func)fd_get_func, flags, &input))
+    return NULL;
+
+  result = parse_json(&lex, flags, error);
+
+  lex_close(&lex);
+  return result;
+}
+
+void jsonp_mapping_decref(jsonp_mapping_t *mapping) {
+  if (JSON_INTERNAL_DECREF(mapping) == 0) {
+#ifndef _WIN32
+    munmap(mapping->base, mapping->size);
+#endif
+    jsonp_free(mapping);
+  }
+}
+
+#ifndef _WIN32
+/* Parse straight from a private mapping of the file. Returns -1 if the
+   file can't be mapped and should be read instead. */
+static int load_mapped(const char *path, size_t flags, json_error_t *error,
+                       json_t **result) {
+  jsonp_mapping_t *mapping;
+  buffer_data_t stream_data;
+  struct stat st;
+  lex_t lex;
+  char *base;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+    close(fd);
+    return -1;
+  }
+
+  /* writable, as strings are terminated in place */
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+              fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  mapping = jsonp_malloc(sizeof(jsonp_mapping_t));
+  if (!mapping) {
+    munmap(base, (size_t)st.st_size);
+    return -1;
+  }
+  mapping->base = base;
+  mapping->size = (size_t)st.st_size;
+  mapping->refcount = 1;
+
+  stream_data.data = base;
+  stream_data.pos = 0;
+  stream_data.len = mapping->size;
+
+  *result = NULL;
+  if (!lex_init(&lex, buffer_get, flags, (void *)&stream_data)) {
+    lex.mapping = mapping;
+    lex.shape = shape_of_input(mapping->size);
+    *result = parse_json(&lex, flags, error);
+    lex_close(&lex);
+  }
+
+  /* unmapped here if no string refers to it */
+  jsonp_mapping_decref(mapping);
+  return 0;
+}
+#endif
+
+json_t *json_load_file(const char *path, size_t flags, json_error_t *error) {
+  json_t *result;
+  FILE *fp;
+
+  jsonp_error_init(error, path);
+
+  if (path == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return NULL;
+  }
+
+#ifndef _WIN32
+  if ((flags & JSON_DECODE_MAPPED) && !load_mapped(path, flags, error, &result))
+    return result;
+#endif
+
+  fp = fopen(path, "rb");
+  if (!fp) {
+    error_set(error, NULL, json_error_cannot_open_file, "unable to open %s: %s",
+              path, strerror(errno));
+    return NULL;
+  }
+
+  result = json_loadf(fp, flags, error);
+
+  fclose(fp);
+  return result;
+}
+
+#define MAX_BUF_LEN 1024
+
+typedef struct {
+  char data[MAX_BUF_LEN];
+  size_t len;
+  size_t pos;
+  json_load_callback_t callback;
+  void *arg;
+} callback_data_t;
+
+static int callback_get(void *data) {
+  char c;
+  callback_data_t *stream = data;
+
+  if (stream->pos >= stream->len) {
+    stream->pos = 0;
+    stream->len = stream->callback(stream->data, MAX_BUF_LEN, stream->arg);
+    if (stream->len == 0 || stream->len == (size_t)-1)
+      return EOF;
+  }
+
+  c = stream->data[stream->pos];
+  stream->pos++;
+  return (unsigned char)c;
+}
+
+json_t *json_load_callback(json_load_callback_t callback, void *arg,
+                           size_t flags, json_error_t *error) {
+  lex_t lex;
+  json_t *result;
+
+  callback_data_t stream_data;
+
+  memset(&stream_data, 0, sizeof(stream_data));
+  stream_data.callback = callback;
+  stream_data.arg = arg;
+
+  jsonp_error_init(error, "<callback>");
+
+  if (callback == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return NULL;
+  }
+
+  if (lex_init(&lex, (get_func)callback_get, flags, &stream_data))
+    return NULL;
+
+  result = parse_json(&lex, flags, error);
+
+  lex_close(&lex);
+  return result;
+}
+
+/*** push parser ***/
+
+/* json_parser_feed() runs the lexer over each chunk as it arrives. A
+   token cut off by the end of a chunk is rolled back and only its
+   bytes are kept, until a later chunk has the byte that can end it.
+   The tree is built on an explicit stack of open containers, as the
+   recursion of parse_value() can't be suspended between chunks. */
+
+#define PUSH_VALUE 0       /* a value */
+#define PUSH_FIRST_VALUE 1 /* a value or ']' */
+#define PUSH_FIRST_KEY 2   /* a key or '}' */
+#define PUSH_KEY 3
+#define PUSH_COLON 4
+#define PUSH_NEXT 5 /* ',' or the end of the container */
+#define PUSH_DONE 6
+#define PUSH_ERROR 7
+
+#define CARRY_STRING 0
+#define CARRY_WORD 1 /* number or literal */
+#define CARRY_OTHER 2
+
+typedef struct {
+  const char *carry;
+  size_t carry_len;
+  const char *data;
+  size_t len;
+  size_t pos; /* in carry, then in data */
+  int ran_out;
+} push_data_t;
+
+typedef struct {
+  json_t *container;
+  char *key; /* waiting for its value */
+  size_t len;
+  size_t hash;
+} push_frame_t;
+
+struct json_parser {
+  lex_t lex;
+  push_data_t input;
+  strbuffer_t carry; /* start of a token split across chunks */
+  int carry_kind;
+  int escaped;
+  push_frame_t *frames;
+  size_t depth;
+  size_t size;
+  json_t *root;
+  size_t flags;
+  int state;
+  int ended;
+  json_error_t error;
+};
+
+static int push_get(void *data) {
+  push_data_t *input = data;
+  size_t pos = input->pos;
+
+  if (pos < input->carry_len) {
+    input->pos++;
+    return (unsigned char)input->carry[pos];
+  }
+
+  pos -= input->carry_len;
+  if (pos < input->len) {
+    input->pos++;
+    return (unsigned char)input->data[pos];
+  }
+
+  input->ran_out = 1;
+  return EOF;
+}
+
+/* Returns the offset of the first byte that may end the carried
+   token, or len if there is none */
+static size_t push_scan(json_parser_t *parser, const char *buffer,
+                        size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = buffer[i];
+
+    if (parser->carry_kind == CARRY_STRING) {
+      if (c < 0x20 || (c == '"' && !parser->escaped))
+        break;
+      parser->escaped = !parser->escaped && c == '\\';
+    } else if (parser->carry_kind == CARRY_WORD) {
+      if (!l_isalpha(c) && !l_isdigit(c) && c != '-' && c != '+' && c != '.')
+        break;
+    } else
+      break;
+  }
+
+  return i;
+}
+
+/* Keep the input from start on for the next chunk */
+static int push_keep(json_parser_t *parser, size_t start) {
+  strbuffer_t *carry = &parser->carry;
+  const push_data_t *input = &parser->input;
+  const char *p, *end;
+
+  if (start < input->carry_len) {
+    carry->length = input->carry_len - start;
+    memmove(carry->value, carry->value + start, carry->length);
+    start = 0;
+  } else {
+    carry->length = 0;
+    start -= input->carry_len;
+  }
+
+  if (strbuffer_append_bytes(carry, input->data + start, input->len - start)) {
+    error_set(&parser->error, NULL, json_error_out_of_memory, "out of memory");
+    return -1;
+  }
+
+  p = carry->value;
+  end = p + carry->length;
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+
+  parser->escaped = 0;
+  if (*p == '"') {
+    parser->carry_kind = CARRY_STRING;
+    push_scan(parser, p + 1, end - p - 1);
+  } else if (l_isalpha(*p) || l_isdigit(*p) || *p == '-')
+    parser->carry_kind = CARRY_WORD;
+  else
+    parser->carry_kind = CARRY_OTHER;
+
+  return 0;
+}
 
-  if (lex_init(&lex, (get_func)fd_get_func, flags, &input))
-    return NULL;
+static int push_add(json_parser_t *parser, json_t *value) {
+  push_frame_t *frame;
+  int result;
 
-  result = parse_json(&lex, flags, error);
+  if (!value)
+    return -1;
 
-  lex_close(&lex);
+  if ((parser->flags & JSON_DECODE_CONFINED) && value->refcount != (size_t)-1)
+    value->flags |= JSON_VALUE_CONFINED;
+
+  if (!parser->depth) {
+    parser->root = value;
+    parser->state = PUSH_DONE;
+    return 0;
+  }
+
+  frame = &parser->frames[parser->depth - 1];
+  parser->state = PUSH_NEXT;
+
+  if (json_is_array(frame->container))
+    return json_array_append_new(frame->container, value);
+
+  result = jsonp_object_setn_new_hashed(frame->container, frame->key,
+                                        frame->len, frame->hash, value);
+  jsonp_free(frame->key);
+  frame->key = NULL;
   return result;
 }
 
-json_t *json_load_file(const char *path, size_t flags, json_error_t *error) {
-  json_t *result;
-  FILE *fp;
+static int push_open(json_parser_t *parser, json_t *container, int state) {
+  push_frame_t *frame;
 
-  jsonp_error_init(error, path);
+  if (!container)
+    return -1;
 
-  if (path == NULL) {
-    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+  if (parser->depth >= JSON_PARSER_MAX_DEPTH) {
+    error_set(&parser->error, &parser->lex, json_error_stack_overflow,
+              "maximum parsing depth reached");
+    json_decref(container);
+    return -1;
+  }
+
+  if (parser->depth == parser->size) {
+    size_t size = parser->size ? parser->size * 2 : 16;
+    push_frame_t *frames =
+        jsonp_realloc(parser->frames, parser->size * sizeof(push_frame_t),
+                      size * sizeof(push_frame_t));
+    if (!frames) {
+      json_decref(container);
+      return -1;
+    }
+    parser->frames = frames;
+    parser->size = size;
+  }
+
+  frame = &parser->frames[parser->depth++];
+  frame->container = container;
+  frame->key = NULL;
+  parser->state = state;
+  return 0;
+}
+
+static int push_close(json_parser_t *parser) {
+  return push_add(parser, parser->frames[--parser->depth].container);
+}
+
+static int push_key(json_parser_t *parser, push_frame_t *frame) {
+  lex_t *lex = &parser->lex;
+  char *key;
+  size_t len, hash;
+
+  key = lex_steal_string(lex, &len);
+  if (!key)
+    return -1;
+  if (memchr(key, '\0', len)) {
+    jsonp_free(key);
+    error_set(&parser->error, lex, json_error_null_byte_in_key,
+              "NUL byte in object key not supported");
+    return -1;
+  }
+
+  hash = jsonp_object_hash(frame->container, key, len);
+  if (parser->flags & JSON_REJECT_DUPLICATES) {
+    if (jsonp_object_getn_hashed(frame->container, key, len, hash)) {
+      jsonp_free(key);
+      error_set(&parser->error, lex, json_error_duplicate_key,
+                "duplicate object key");
+      return -1;
+    }
+  }
+
+  frame->key = key;
+  frame->len = len;
+  frame->hash = hash;
+  parser->state = PUSH_COLON;
+  return 0;
+}
+
+static int push_value(json_parser_t *parser, push_frame_t *frame) {
+  lex_t *lex = &parser->lex;
+  json_error_t *error = &parser->error;
+  size_t flags = parser->flags;
+  int packed = (flags & JSON_PACKED_ARRAYS) && frame &&
+               json_is_array(frame->container);
+  json_t *json;
+
+  if (!frame && !(flags & JSON_DECODE_ANY)) {
+    if (lex->token != '[' && lex->token != '{') {
+      error_set(error, lex, json_error_invalid_syntax, "'[' or '{' expected");
+      return -1;
+    }
+  }
+
+  switch (lex->token) {
+  case TOKEN_STRING: {
+    const char *value = lex->value.string.val;
+    size_t len = lex->value.string.len;
+
+    if (!(flags & JSON_ALLOW_NUL)) {
+      if (memchr(value, '\0', len)) {
+        error_set(error, lex, json_error_null_character,
+                  "\\u0000 is not allowed without JSON_ALLOW_NUL");
+        return -1;
+      }
+    }
+
+    json = jsonp_stringn_nocheck_own(value, len);
+    lex->value.string.val = NULL;
+    lex->value.string.len = 0;
+    break;
+  }
+
+  case TOKEN_INTEGER:
+    if (packed) {
+      parser->state = PUSH_NEXT;
+      return jsonp_array_append_integer(frame->container, lex->value.integer);
+    }
+    json = json_integer(lex->value.integer);
+    break;
+
+  case TOKEN_REAL:
+    if (packed) {
+      parser->state = PUSH_NEXT;
+      return jsonp_array_append_real(frame->container, lex->value.real);
+    }
+    json = json_real(lex->value.real);
+    break;
+
+  case TOKEN_TRUE:
+    json = json_true();
+    break;
+
+  case TOKEN_FALSE:
+    json = json_false();
+    break;
+
+  case TOKEN_NULL:
+    json = json_null();
+    break;
+
+  case '{':
+    return push_open(parser, json_object(), PUSH_FIRST_KEY);
+
+  case '[':
+    return push_open(parser, json_array(), PUSH_FIRST_VALUE);
+
+  case TOKEN_INVALID:
+    error_set(error, lex, json_error_invalid_syntax, "invalid token");
+    return -1;
+
+  default:
+    error_set(error, lex, json_error_invalid_syntax, "unexpected token");
+    return -1;
+  }
+
+  return push_add(parser, json);
+}
+
+static int push_token(json_parser_t *parser) {
+  lex_t *lex = &parser->lex;
+  push_frame_t *frame =
+      parser->depth ? &parser->frames[parser->depth - 1] : NULL;
+
+  switch (parser->state) {
+  case PUSH_FIRST_KEY:
+    if (lex->token == '}')
+      return push_close(parser);
+    /* fall through */
+  case PUSH_KEY:
+    if (lex->token != TOKEN_STRING) {
+      error_set(&parser->error, lex, json_error_invalid_syntax,
+                "string or '}' expected");
+      return -1;
+    }
+    return push_key(parser, frame);
+
+  case PUSH_COLON:
+    if (lex->token != ':') {
+      error_set(&parser->error, lex, json_error_invalid_syntax,
+                "':' expected");
+      return -1;
+    }
+    parser->state = PUSH_VALUE;
+    return 0;
+
+  case PUSH_FIRST_VALUE:
+    if (lex->token == ']')
+      return push_close(parser);
+    /* fall through */
+  case PUSH_VALUE:
+    return push_value(parser, frame);
+
+  case PUSH_NEXT:
+    if (json_is_object(frame->container)) {
+      if (lex->token == ',') {
+        parser->state = PUSH_KEY;
+        return 0;
+      }
+      if (lex->token == '}')
+        return push_close(parser);
+      error_set(&parser->error, lex, json_error_invalid_syntax,
+                "'}' expected");
+    } else {
+      if (lex->token == ',') {
+        parser->state = PUSH_VALUE;
+        return 0;
+      }
+      if (lex->token == ']')
+        return push_close(parser);
+      error_set(&parser->error, lex, json_error_invalid_syntax,
+                "']' expected");
+    }
+    return -1;
+
+  default: /* PUSH_DONE */
+    if (lex->token == TOKEN_EOF || (parser->flags & JSON_DISABLE_EOF_CHECK))
+      return 0;
+    error_set(&parser->error, lex, json_error_end_of_input_expected,
+              "end of file expected");
+    return -1;
+  }
+}
+
+json_parser_t *json_parser_new(size_t flags) {
+  json_parser_t *parser = jsonp_malloc(sizeof(json_parser_t));
+  if (!parser)
+    return NULL;
+
+  memset(&parser->input, 0, sizeof(push_data_t));
+  if (strbuffer_init_pooled(&parser->carry)) {
+    jsonp_free(parser);
+    return NULL;
+  }
+  if (lex_init(&parser->lex, push_get, flags, &parser->input)) {
+    strbuffer_close_pooled(&parser->carry);
+    jsonp_free(parser);
     return NULL;
   }
 
-  fp = fopen(path, "rb");
-  if (!fp) {
-    error_set(error, NULL, json_error_cannot_open_file, "unable to open %s: %s",
-              path, strerror(errno));
+  parser->frames = NULL;
+  parser->depth = 0;
+  parser->size = 0;
+  parser->root = NULL;
+  parser->flags = flags;
+  parser->state = PUSH_VALUE;
+  parser->ended = 0;
+  jsonp_error_init(&parser->error, "<stream>");
+  return parser;
+}
+
+int json_parser_feed(json_parser_t *parser, const char *buffer,
+                     size_t buflen) {
+  push_data_t *input;
+  lex_t *lex;
+  int last = buffer == NULL;
+
+  if (!parser || parser->state == PUSH_ERROR)
+    return -1;
+
+  if (parser->ended || (!last && !buflen) ||
+      (parser->state == PUSH_DONE && (parser->flags & JSON_DISABLE_EOF_CHECK)))
+    return parser->state == PUSH_DONE ? JSON_PARSER_DONE
+                                      : JSON_PARSER_NEED_MORE;
+
+  if (last)
+    parser->ended = 1;
+  else if (parser->carry.length &&
+           push_scan(parser, buffer, buflen) == buflen) {
+    /* the carried token goes on past this chunk */
+    if (strbuffer_append_bytes(&parser->carry, buffer, buflen)) {
+      error_set(&parser->error, NULL, json_error_out_of_memory,
+                "out of memory");
+      parser->state = PUSH_ERROR;
+      return -1;
+    }
+    return JSON_PARSER_NEED_MORE;
+  }
+
+  input = &parser->input;
+  input->carry = parser->carry.value;
+  input->carry_len = parser->carry.length;
+  input->data = buffer;
+  input->len = last ? 0 : buflen;
+  input->pos = 0;
+
+  lex = &parser->lex;
+  lex->stream.state = STREAM_STATE_OK;
+
+  while (1) {
+    stream_t saved = lex->stream;
+    size_t start = input->pos;
+
+    input->ran_out = 0;
+    lex_scan(lex, &parser->error);
+
+    if (input->ran_out && !last) {
+      if (lex->token == TOKEN_EOF) {
+        strbuffer_clear(&parser->carry);
+        break;
+      }
+
+      /* roll the cut off token back, no error was real */
+      lex->stream = saved;
+      parser->error.text[0] = '\0';
+      if (push_keep(parser, start)) {
+        parser->state = PUSH_ERROR;
+        return -1;
+      }
+      break;
+    }
+
+    if (push_token(parser)) {
+      parser->state = PUSH_ERROR;
+      return -1;
+    }
+
+    if (lex->token == TOKEN_EOF || (parser->state == PUSH_DONE &&
+                                    (parser->flags & JSON_DISABLE_EOF_CHECK))) {
+      strbuffer_clear(&parser->carry);
+      break;
+    }
+  }
+
+  return parser->state == PUSH_DONE ? JSON_PARSER_DONE : JSON_PARSER_NEED_MORE;
+}
+
+json_t *json_parser_result(json_parser_t *parser, json_error_t *error) {
+  if (!parser) {
+    jsonp_error_init(error, "<stream>");
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
     return NULL;
   }
 
-  result = json_loadf(fp, flags, error);
+  if (error)
+    *error = parser->error;
 
-  fclose(fp);
+  if (parser->state == PUSH_DONE) {
+    if (error) {
+      /* Save the position even though there was no error */
+      error->position = (int)parser->lex.stream.position;
+    }
+    return json_incref(parser->root);
+  }
+
+  if (parser->state != PUSH_ERROR)
+    jsonp_error_set(error, parser->lex.stream.line, parser->lex.stream.column,
+                    parser->lex.stream.position,
+                    json_error_premature_end_of_input,
+                    "premature end of input");
+  return NULL;
+}
+
+void json_parser_free(json_parser_t *parser) {
+  if (!parser)
+    return;
+
+  while (parser->depth--) {
+    json_decref(parser->frames[parser->depth].container);
+    jsonp_free(parser->frames[parser->depth].key);
+  }
+  jsonp_free(parser->frames);
+  json_decref(parser->root);
+
+  lex_close(&parser->lex);
+  strbuffer_close_pooled(&parser->carry);
+  jsonp_free(parser);
+}
+
+int json_sax_loads(const char *string, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error) {
+  lex_t lex;
+  int result;
+  string_data_t stream_data;
+
+  jsonp_error_init(error, "<string>");
+
+  if (string == NULL || handlers == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return -1;
+  }
+
+  stream_data.data = string;
+  stream_data.pos = 0;
+
+  if (lex_init(&lex, string_get, flags, (void *)&stream_data))
+    return -1;
+
+  result = sax_json(&lex, handlers, data, flags, error);
+
+  lex_close(&lex);
   return result;
 }
 
-#define MAX_BUF_LEN 1024
+int json_sax_loadb(const char *buffer, size_t buflen, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error) {
+  lex_t lex;
+  int result;
+  buffer_data_t stream_data;
 
-typedef struct {
-  char data[MAX_BUF_LEN];
-  size_t len;
-  size_t pos;
-  json_load_callback_t callback;
-  void *arg;
-} callback_data_t;
+  jsonp_error_init(error, "<buffer>");
 
-static int callback_get(void *data) {
-  char c;
-  callback_data_t *stream = data;
+  if (buffer == NULL || handlers == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return -1;
+  }
 
-  if (stream->pos >= stream->len) {
-    stream->pos = 0;
-    stream->len = stream->callback(stream->data, MAX_BUF_LEN, stream->arg);
-    if (stream->len == 0 || stream->len == (size_t)-1)
-      return EOF;
+  stream_data.data = buffer;
+  stream_data.pos = 0;
+  stream_data.len = buflen;
+
+  if (lex_init(&lex, buffer_get, flags, (void *)&stream_data))
+    return -1;
+
+  result = sax_json(&lex, handlers, data, flags, error);
+
+  lex_close(&lex);
+  return result;
+}
+
+int json_sax_loadf(FILE *input, size_t flags,
+                   const json_sax_handlers_t *handlers, void *data,
+                   json_error_t *error) {
+  lex_t lex;
+  int result;
+
+  jsonp_error_init(error, input == stdin ? "<stdin>" : "<stream>");
+
+  if (input == NULL || handlers == NULL) {
+    error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
+    return -1;
   }
 
-  c = stream->data[stream->pos];
-  stream->pos++;
-  return (unsigned char)c;
+  if (lex_init(&lex, (get_func)fgetc, flags, input))
+    return -1;
+
+  result = sax_json(&lex, handlers, data, flags, error);
+
+  lex_close(&lex);
+  return result;
 }
 
-json_t *json_load_callback(json_load_callback_t callback, void *arg,
-                           size_t flags, json_error_t *error) {
+int json_sax_load_callback(json_load_callback_t callback, void *arg,
+                           size_t flags, const json_sax_handlers_t *handlers,
+                           void *data, json_error_t *error) {
   lex_t lex;
-  json_t *result;
+  int result;
 
   callback_data_t stream_data;
 
@@ -1105,15 +3054,15 @@ json_t *json_load_callback(json_load_callback_t callback, void *arg,
 
   jsonp_error_init(error, "<callback>");
 
-  if (callback == NULL) {
+  if (callback == NULL || handlers == NULL) {
     error_set(error, NULL, json_error_invalid_argument, "wrong arguments");
-    return NULL;
+    return -1;
   }
 
   if (lex_init(&lex, (get_func)callback_get, flags, &stream_data))
-    return NULL;
+    return -1;
 
-  result = parse_json(&lex, flags, error);
+  result = sax_json(&lex, handlers, data, flags, error);
 
   lex_close(&lex);
   return result;
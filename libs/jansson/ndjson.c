@@ -0,0 +1,409 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Bulk loading of newline-delimited JSON. The input is cut into
+   chunks at line boundaries, worker threads parse whole chunks with
+   json_loadb() and the calling thread hands the values to the callback
+   chunk by chunk, in input order. Only a window of chunks ahead of the
+   one being delivered is parsed, so memory stays bounded however long
+   the input is. Files are mapped instead of read. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jansson.h"
+#include "jansson_private.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Chunks are about this big, smaller if that leaves threads idle */
+#define NDJSON_CHUNK_MIN (64 * 1024)
+#define NDJSON_CHUNK_MAX (1024 * 1024)
+/* Chunks parsed ahead of delivery, per thread */
+#define NDJSON_WINDOW 2
+
+typedef struct {
+    const char *start;
+    const char *end;
+    json_t **values;
+    size_t *lines; /* of values, counted from the chunk start */
+    size_t count;
+    size_t size;
+    size_t line_count;
+    int done;
+    int failed;
+    size_t error_line;
+    json_error_t error;
+} ndjson_chunk_t;
+
+typedef struct {
+    ndjson_chunk_t *chunks;
+    size_t nchunks;
+    size_t flags;
+    size_t window;
+    size_t next;      /* chunk to parse next */
+    size_t delivered; /* chunks handed to the callback */
+    int stop;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t work; /* the window moved or stop was set */
+    pthread_cond_t done; /* a chunk was parsed */
+#endif
+} ndjson_t;
+
+static int is_blank(const char *p, const char *end) {
+    while (p < end) {
+        if (*p != ' ' && *p != '\t' && *p != '\r')
+            return 0;
+        p++;
+    }
+    return 1;
+}
+
+static void parse_chunk(ndjson_chunk_t *chunk, size_t flags) {
+    const char *p = chunk->start;
+
+    while (p < chunk->end) {
+        const char *eol = memchr(p, '\n', chunk->end - p);
+        const char *end = eol ? eol : chunk->end;
+        size_t line = chunk->line_count++;
+
+        if (!is_blank(p, end)) {
+            json_t *value = json_loadb(p, end - p, flags, &chunk->error);
+
+            if (value && chunk->count == chunk->size) {
+                size_t size = chunk->size ? chunk->size * 2 : 64;
+                json_t **values = jsonp_realloc(chunk->values,
+                                                chunk->size * sizeof(json_t *),
+                                                size * sizeof(json_t *));
+                size_t *lines = values ? jsonp_realloc(chunk->lines,
+                                                       chunk->size * sizeof(size_t),
+                                                       size * sizeof(size_t))
+                                       : NULL;
+                if (values)
+                    chunk->values = values;
+                if (lines) {
+                    chunk->lines = lines;
+                    chunk->size = size;
+                } else {
+                    json_decref(value);
+                    value = NULL;
+                    jsonp_error_init(&chunk->error, NULL);
+                    jsonp_error_set(&chunk->error, -1, -1, 0, json_error_out_of_memory,
+                                    "out of memory");
+                }
+            }
+
+            if (!value) {
+                chunk->failed = 1;
+                chunk->error_line = line;
+                /* the error position is within the line */
+                chunk->error.position += (int)(p - chunk->start);
+                return;
+            }
+
+            chunk->values[chunk->count] = value;
+            chunk->lines[chunk->count] = line;
+            chunk->count++;
+        }
+
+        p = end + 1;
+    }
+}
+
+static void free_chunk(ndjson_chunk_t *chunk) {
+    size_t i;
+
+    for (i = 0; i < chunk->count; i++)
+        json_decref(chunk->values[i]);
+    jsonp_free(chunk->values);
+    jsonp_free(chunk->lines);
+    chunk->values = NULL;
+    chunk->lines = NULL;
+    chunk->count = 0;
+}
+
+/* Returns 0 to go on, -1 if the chunk failed to parse and 1 if the
+   callback stopped */
+static int deliver_chunk(ndjson_chunk_t *chunk, size_t first_line, size_t offset,
+                         json_ndjson_callback_t callback, void *data,
+                         json_error_t *error) {
+    size_t i;
+    int result = 0;
+
+    for (i = 0; i < chunk->count; i++) {
+        if (callback(chunk->values[i], first_line + chunk->lines[i], data)) {
+            result = 1;
+            break;
+        }
+    }
+
+    if (!result && chunk->failed) {
+        jsonp_error_set(error, (int)(first_line + chunk->error_line),
+                        chunk->error.column, offset + chunk->error.position,
+                        json_error_code(&chunk->error), "%s", chunk->error.text);
+        result = -1;
+    }
+
+    free_chunk(chunk);
+    return result;
+}
+
+#ifndef _WIN32
+
+static void *worker(void *arg) {
+    ndjson_t *nd = arg;
+
+    pthread_mutex_lock(&nd->lock);
+    while (1) {
+        size_t i;
+
+        while (!nd->stop && nd->next < nd->nchunks &&
+               nd->next >= nd->delivered + nd->window)
+            pthread_cond_wait(&nd->work, &nd->lock);
+
+        if (nd->stop || nd->next >= nd->nchunks)
+            break;
+
+        i = nd->next++;
+        pthread_mutex_unlock(&nd->lock);
+
+        parse_chunk(&nd->chunks[i], nd->flags);
+
+        pthread_mutex_lock(&nd->lock);
+        nd->chunks[i].done = 1;
+        pthread_cond_broadcast(&nd->done);
+    }
+    pthread_mutex_unlock(&nd->lock);
+
+    return NULL;
+}
+
+static size_t default_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (size_t)n : 1;
+}
+
+#else
+
+static size_t default_threads(void) { return 1; }
+
+#endif
+
+int json_loadb_ndjson(const char *buffer, size_t buflen, size_t flags, size_t threads,
+                      json_ndjson_callback_t callback, void *data,
+                      json_error_t *error) {
+    ndjson_t nd;
+    size_t chunk_size, first_line = 1, i, started = 0;
+    const char *p, *end;
+    int result = 0;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if ((!buffer && buflen) || !callback) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "wrong arguments");
+        return -1;
+    }
+
+    if (!threads)
+        threads = default_threads();
+
+    chunk_size = buflen / (threads * NDJSON_WINDOW * 4);
+    if (chunk_size < NDJSON_CHUNK_MIN)
+        chunk_size = NDJSON_CHUNK_MIN;
+    else if (chunk_size > NDJSON_CHUNK_MAX)
+        chunk_size = NDJSON_CHUNK_MAX;
+
+    nd.nchunks = buflen / chunk_size + 1;
+    nd.chunks = jsonp_malloc(nd.nchunks * sizeof(ndjson_chunk_t));
+    if (!nd.chunks) {
+        jsonp_error_set(error, -1, -1, 0, json_error_out_of_memory, "out of memory");
+        return -1;
+    }
+
+    /* cut after the first newline past each chunk_size bytes */
+    p = buffer;
+    end = buffer + buflen;
+    for (i = 0; p < end; i++) {
+        const char *eol = NULL;
+
+        if ((size_t)(end - p) > chunk_size)
+            eol = memchr(p + chunk_size, '\n', end - p - chunk_size);
+
+        memset(&nd.chunks[i], 0, sizeof(ndjson_chunk_t));
+        nd.chunks[i].start = p;
+        nd.chunks[i].end = eol ? eol + 1 : end;
+        p = nd.chunks[i].end;
+    }
+    nd.nchunks = i;
+
+    nd.flags = flags;
+    nd.window = threads * NDJSON_WINDOW;
+    nd.next = 0;
+    nd.delivered = 0;
+    nd.stop = 0;
+
+#ifndef _WIN32
+    if (threads > 1 && nd.nchunks > 1) {
+        pthread_t *workers = jsonp_malloc(threads * sizeof(pthread_t));
+
+        if (threads > nd.nchunks)
+            threads = nd.nchunks;
+
+        pthread_mutex_init(&nd.lock, NULL);
+        pthread_cond_init(&nd.work, NULL);
+        pthread_cond_init(&nd.done, NULL);
+
+        for (; workers && started < threads; started++) {
+            if (pthread_create(&workers[started], NULL, worker, &nd))
+                break;
+        }
+
+        if (started) {
+            for (i = 0; i < nd.nchunks && !result; i++) {
+                ndjson_chunk_t *chunk = &nd.chunks[i];
+
+                pthread_mutex_lock(&nd.lock);
+                while (!chunk->done)
+                    pthread_cond_wait(&nd.done, &nd.lock);
+                pthread_mutex_unlock(&nd.lock);
+
+                result = deliver_chunk(chunk, first_line, chunk->start - buffer,
+                                       callback, data, error);
+                first_line += chunk->line_count;
+
+                pthread_mutex_lock(&nd.lock);
+                nd.delivered = i + 1;
+                if (result)
+                    nd.stop = 1;
+                pthread_cond_broadcast(&nd.work);
+                pthread_mutex_unlock(&nd.lock);
+            }
+
+            for (i = 0; i < started; i++)
+                pthread_join(workers[i], NULL);
+
+            /* parsed ahead of a stop */
+            for (i = 0; i < nd.nchunks; i++)
+                free_chunk(&nd.chunks[i]);
+        }
+
+        jsonp_free(workers);
+        pthread_cond_destroy(&nd.done);
+        pthread_cond_destroy(&nd.work);
+        pthread_mutex_destroy(&nd.lock);
+    }
+#endif
+
+    if (!started) {
+        /* one thread, or none could be started */
+        for (i = 0; i < nd.nchunks && !result; i++) {
+            ndjson_chunk_t *chunk = &nd.chunks[i];
+
+            parse_chunk(chunk, flags);
+            result = deliver_chunk(chunk, first_line, chunk->start - buffer, callback,
+                                   data, error);
+            first_line += chunk->line_count;
+        }
+    }
+
+    jsonp_free(nd.chunks);
+    return result;
+}
+
+int json_load_ndjson_file(const char *path, size_t flags, size_t threads,
+                          json_ndjson_callback_t callback, void *data,
+                          json_error_t *error) {
+    char *buffer;
+    size_t size;
+    int result;
+
+    jsonp_error_init(error, path);
+
+    if (path == NULL) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "wrong arguments");
+        return -1;
+    }
+
+#ifndef _WIN32
+    {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to open %s: %s", path, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return -1;
+        }
+
+        size = (size_t)st.st_size;
+        buffer = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        close(fd);
+
+        if (buffer == MAP_FAILED) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to map %s: %s", path, strerror(errno));
+            return -1;
+        }
+#ifdef MADV_SEQUENTIAL
+        if (buffer)
+            madvise(buffer, size, MADV_SEQUENTIAL);
+#endif
+    }
+#else
+    {
+        FILE *fp = fopen(path, "rb");
+        long length;
+
+        if (!fp || fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 ||
+            fseek(fp, 0, SEEK_SET)) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to open %s: %s", path, strerror(errno));
+            if (fp)
+                fclose(fp);
+            return -1;
+        }
+
+        size = (size_t)length;
+        buffer = jsonp_malloc(size + 1);
+        if (!buffer || fread(buffer, 1, size, fp) != size) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to read %s", path);
+            jsonp_free(buffer);
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+    }
+#endif
+
+    result = json_loadb_ndjson(buffer, size, flags, threads, callback, data, error);
+    if (error)
+        jsonp_error_set_source(error, path);
+
+#ifndef _WIN32
+    if (buffer)
+        munmap(buffer, size);
+#else
+    jsonp_free(buffer);
+#endif
+    return result;
+}
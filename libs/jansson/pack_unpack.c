@@ -21,6 +21,7 @@ typedef struct {
 typedef struct {
     const char *start;
     const char *fmt;
+    const token_t *tokens; /* scanned format, fmt is unused */
     token_t prev_token;
     token_t token;
     token_t next_token;
@@ -46,6 +47,7 @@ static void scanner_init(scanner_t *s, json_error_t *error, size_t flags,
     s->error = error;
     s->flags = flags;
     s->fmt = s->start = fmt;
+    s->tokens = NULL;
     memset(&s->prev_token, 0, sizeof(token_t));
     memset(&s->token, 0, sizeof(token_t));
     memset(&s->next_token, 0, sizeof(token_t));
@@ -65,6 +67,14 @@ static void next_token(scanner_t *s) {
         return;
     }
 
+    if (s->tokens) {
+        /* stays on the terminating token */
+        s->token = *s->tokens;
+        if (s->token.token)
+            s->tokens++;
+        return;
+    }
+
     if (!token(s) && !*s->fmt)
         return;
 
@@ -818,34 +828,143 @@ static int unpack(scanner_t *s, json_t *root, va_list *ap) {
     }
 }
 
-json_t *json_vpack_ex(json_error_t *error, size_t flags, const char *fmt, va_list ap) {
-    scanner_t s;
-    va_list ap_copy;
-    json_t *value;
+static int compile(scanner_t *s, json_template_t *tpl, va_list *ap);
 
-    if (!fmt || !*fmt) {
-        jsonp_error_init(error, "<format>");
-        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
-                        "NULL or empty format string");
-        return NULL;
+static int compile_out_of_memory(scanner_t *s) {
+    set_error(s, "<internal>", json_error_out_of_memory, "Out of memory");
+    return -1;
+}
+
+static int compile_object(scanner_t *s, json_template_t *tpl, va_list *ap) {
+    if (jsonp_template_open(tpl, '{'))
+        return compile_out_of_memory(s);
+    next_token(s);
+
+    while (token(s) != '}') {
+        const char *key;
+        size_t key_len;
+
+        if (!token(s)) {
+            set_error(s, "<format>", json_error_invalid_format,
+                      "Unexpected end of format string");
+            return -1;
+        }
+
+        if (token(s) != 's') {
+            set_error(s, "<format>", json_error_invalid_format,
+                      "Expected format 's', got '%c'", token(s));
+            return -1;
+        }
+
+        key = va_arg(*ap, const char *);
+        if (!key) {
+            set_error(s, "<args>", json_error_null_value, "NULL object key");
+            return -1;
+        }
+
+        key_len = strlen(key);
+        if (!utf8_check_string(key, key_len)) {
+            set_error(s, "<args>", json_error_invalid_utf8, "Invalid UTF-8 object key");
+            return -1;
+        }
+
+        if (jsonp_template_key(tpl, key, key_len))
+            return compile_out_of_memory(s);
+
+        next_token(s);
+        if (compile(s, tpl, ap))
+            return -1;
+
+        next_token(s);
     }
-    jsonp_error_init(error, NULL);
 
-    scanner_init(&s, error, flags, fmt);
-    next_token(&s);
+    if (jsonp_template_close(tpl))
+        return compile_out_of_memory(s);
+    return 0;
+}
+
+static int compile_array(scanner_t *s, json_template_t *tpl, va_list *ap) {
+    if (jsonp_template_open(tpl, '['))
+        return compile_out_of_memory(s);
+    next_token(s);
+
+    while (token(s) != ']') {
+        if (!token(s)) {
+            set_error(s, "<format>", json_error_invalid_format,
+                      "Unexpected end of format string");
+            return -1;
+        }
+
+        if (compile(s, tpl, ap))
+            return -1;
+
+        next_token(s);
+    }
+
+    if (jsonp_template_close(tpl))
+        return compile_out_of_memory(s);
+    return 0;
+}
+
+static int compile(scanner_t *s, json_template_t *tpl, va_list *ap) {
+    char type = token(s);
+    int nullable = 0;
+
+    switch (type) {
+        case '{':
+            return compile_object(s, tpl, ap);
+
+        case '[':
+            return compile_array(s, tpl, ap);
+
+        case 's': /* const char *, "s?" writes null for NULL */
+            next_token(s);
+            if (token(s) == '?')
+                nullable = 1;
+            else
+                prev_token(s);
+            break;
+
+        case 'n': /* null, takes no argument */
+            if (jsonp_template_slot(tpl, type, 0, 0))
+                return compile_out_of_memory(s);
+            return 0;
+
+        case 'b': /* int */
+        case 'i': /* int */
+        case 'I': /* json_int_t */
+        case 'f': /* double */
+            break;
+
+        default:
+            set_error(s, "<format>", json_error_invalid_format,
+                      "Unexpected format character '%c'", type);
+            return -1;
+    }
+
+    if (jsonp_template_slot(tpl, type, va_arg(*ap, size_t), nullable))
+        return compile_out_of_memory(s);
+    return 0;
+}
+
+static json_t *vpack(scanner_t *s, va_list ap) {
+    va_list ap_copy;
+    json_t *value;
+
+    next_token(s);
 
     va_copy(ap_copy, ap);
-    value = pack(&s, &ap_copy);
+    value = pack(s, &ap_copy);
     va_end(ap_copy);
 
     /* This will cover all situations where s.has_error is true */
     if (!value)
         return NULL;
 
-    next_token(&s);
-    if (token(&s)) {
+    next_token(s);
+    if (token(s)) {
         json_decref(value);
-        set_error(&s, "<format>", json_error_invalid_format,
+        set_error(s, "<format>", json_error_invalid_format,
                   "Garbage after format string");
         return NULL;
     }
@@ -853,6 +972,43 @@ json_t *json_vpack_ex(json_error_t *error, size_t flags, const char *fmt, va_lis
     return value;
 }
 
+static int vunpack(scanner_t *s, json_t *root, va_list ap) {
+    va_list ap_copy;
+
+    next_token(s);
+
+    va_copy(ap_copy, ap);
+    if (unpack(s, root, &ap_copy)) {
+        va_end(ap_copy);
+        return -1;
+    }
+    va_end(ap_copy);
+
+    next_token(s);
+    if (token(s)) {
+        set_error(s, "<format>", json_error_invalid_format,
+                  "Garbage after format string");
+        return -1;
+    }
+
+    return 0;
+}
+
+json_t *json_vpack_ex(json_error_t *error, size_t flags, const char *fmt, va_list ap) {
+    scanner_t s;
+
+    if (!fmt || !*fmt) {
+        jsonp_error_init(error, "<format>");
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "NULL or empty format string");
+        return NULL;
+    }
+    jsonp_error_init(error, NULL);
+
+    scanner_init(&s, error, flags, fmt);
+    return vpack(&s, ap);
+}
+
 json_t *json_pack_ex(json_error_t *error, size_t flags, const char *fmt, ...) {
     json_t *value;
     va_list ap;
@@ -878,7 +1034,6 @@ json_t *json_pack(const char *fmt, ...) {
 int json_vunpack_ex(json_t *root, json_error_t *error, size_t flags, const char *fmt,
                     va_list ap) {
     scanner_t s;
-    va_list ap_copy;
 
     if (!root) {
         jsonp_error_init(error, "<root>");
@@ -895,23 +1050,7 @@ int json_vunpack_ex(json_t *root, json_error_t *error, size_t flags, const char
     jsonp_error_init(error, NULL);
 
     scanner_init(&s, error, flags, fmt);
-    next_token(&s);
-
-    va_copy(ap_copy, ap);
-    if (unpack(&s, root, &ap_copy)) {
-        va_end(ap_copy);
-        return -1;
-    }
-    va_end(ap_copy);
-
-    next_token(&s);
-    if (token(&s)) {
-        set_error(&s, "<format>", json_error_invalid_format,
-                  "Garbage after format string");
-        return -1;
-    }
-
-    return 0;
+    return vunpack(&s, root, ap);
 }
 
 int json_unpack_ex(json_t *root, json_error_t *error, size_t flags, const char *fmt,
@@ -936,3 +1075,189 @@ int json_unpack(json_t *root, const char *fmt, ...) {
 
     return ret;
 }
+
+/* A scanned format caches the scanner's token sequence, with the
+   positions used in error messages, so the format string isn't
+   tokenized again on every call. pack() and unpack() still interpret
+   the tokens each time, and format errors are only reported then. */
+struct json_format {
+    size_t length;
+    token_t tokens[1]; /* terminated by a 0 token */
+};
+
+json_format_t *json_format_scan(const char *fmt) {
+    json_format_t *format;
+    scanner_t s;
+    size_t length, i;
+
+    if (!fmt || !*fmt)
+        return NULL;
+
+    /* one token per format character at most */
+    length = strlen(fmt) + 1;
+    format = jsonp_malloc(offsetof(json_format_t, tokens) + length * sizeof(token_t));
+    if (!format)
+        return NULL;
+
+    scanner_init(&s, NULL, 0, fmt);
+    for (i = 0; i < length; i++) {
+        next_token(&s);
+        format->tokens[i] = s.token;
+        if (!token(&s))
+            break;
+    }
+    format->length = i + 1;
+
+    return format;
+}
+
+static void scanner_init_scanned(scanner_t *s, json_error_t *error, size_t flags,
+                                  const json_format_t *format) {
+    scanner_init(s, error, flags, "");
+    s->tokens = format->tokens;
+}
+
+json_t *json_vpack_exec(const json_format_t *format, json_error_t *error,
+                        size_t flags, va_list ap) {
+    scanner_t s;
+
+    if (!format) {
+        jsonp_error_init(error, "<format>");
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "NULL format");
+        return NULL;
+    }
+    jsonp_error_init(error, NULL);
+
+    scanner_init_scanned(&s, error, flags, format);
+    return vpack(&s, ap);
+}
+
+json_t *json_pack_exec(const json_format_t *format, json_error_t *error, size_t flags,
+                       ...) {
+    json_t *value;
+    va_list ap;
+
+    va_start(ap, flags);
+    value = json_vpack_exec(format, error, flags, ap);
+    va_end(ap);
+
+    return value;
+}
+
+int json_vunpack_exec(json_t *root, const json_format_t *format, json_error_t *error,
+                      size_t flags, va_list ap) {
+    scanner_t s;
+
+    if (!root) {
+        jsonp_error_init(error, "<root>");
+        jsonp_error_set(error, -1, -1, 0, json_error_null_value, "NULL root value");
+        return -1;
+    }
+
+    if (!format) {
+        jsonp_error_init(error, "<format>");
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "NULL format");
+        return -1;
+    }
+    jsonp_error_init(error, NULL);
+
+    scanner_init_scanned(&s, error, flags, format);
+    return vunpack(&s, root, ap);
+}
+
+int json_unpack_exec(json_t *root, const json_format_t *format, json_error_t *error,
+                     size_t flags, ...) {
+    int ret;
+    va_list ap;
+
+    va_start(ap, flags);
+    ret = json_vunpack_exec(root, format, error, flags, ap);
+    va_end(ap);
+
+    return ret;
+}
+
+void json_format_free(json_format_t *format) { jsonp_free(format); }
+
+json_template_t *json_template_vcompile(json_error_t *error, size_t flags,
+                                        const char *fmt, va_list ap) {
+    scanner_t s;
+    va_list ap_copy;
+    json_template_t *tpl;
+    int res;
+
+    if (!fmt || !*fmt) {
+        jsonp_error_init(error, "<format>");
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "NULL or empty format string");
+        return NULL;
+    }
+    jsonp_error_init(error, NULL);
+
+    scanner_init(&s, error, flags, fmt);
+    next_token(&s);
+
+    if (!(flags & JSON_ENCODE_ANY) && token(&s) != '{' && token(&s) != '[') {
+        set_error(&s, "<format>", json_error_invalid_format,
+                  "Expected '{' or '[', got '%c'", token(&s));
+        return NULL;
+    }
+
+    tpl = jsonp_template_new(flags);
+    if (!tpl) {
+        compile_out_of_memory(&s);
+        return NULL;
+    }
+
+    va_copy(ap_copy, ap);
+    res = compile(&s, tpl, &ap_copy);
+    va_end(ap_copy);
+
+    if (res)
+        goto error;
+
+    next_token(&s);
+    if (token(&s)) {
+        set_error(&s, "<format>", json_error_invalid_format,
+                  "Garbage after format string");
+        goto error;
+    }
+
+    if (jsonp_template_end(tpl)) {
+        compile_out_of_memory(&s);
+        goto error;
+    }
+
+    return tpl;
+
+error:
+    json_template_free(tpl);
+    return NULL;
+}
+
+/*
+ * Compiles a json_pack()-like format into a template that writes
+ * members of a struct. Keys are given as strings, values as offsets:
+ *
+ *   json_template_compile(&error, JSON_COMPACT, "{s:s, s:f}",
+ *                         "city", offsetof(weather_t, city),
+ *                         "temp", offsetof(weather_t, temp));
+ *
+ * 's' is a const char * member ("s?" writes null for NULL), 'i' and
+ * 'b' an int, 'I' a json_int_t and 'f' a double. 'n' writes null and
+ * takes no argument. Keys are written in format order, so
+ * JSON_SORT_KEYS has no effect.
+ */
+json_template_t *json_template_compile(json_error_t *error, size_t flags,
+                                       const char *fmt, ...) {
+    json_template_t *tpl;
+    va_list ap;
+
+    va_start(ap, fmt);
+    tpl = json_template_vcompile(error, flags, fmt, ap);
+    va_end(ap);
+
+    return tpl;
+}
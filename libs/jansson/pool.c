@@ -0,0 +1,281 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Per-thread size-class pool allocator. Meant to be installed with
+
+     json_set_alloc_funcs2(json_pool_malloc, json_pool_realloc,
+                           json_pool_free);
+
+   before any json_t is created. Small blocks come from per-thread
+   free lists, so worker threads building values don't contend on the
+   system allocator. Blocks freed by a thread that exits, or piling up
+   in a thread that frees more than it allocates, go to a shared depot
+   other threads refill from. Slabs are never returned to the
+   system. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jansson.h"
+#include "jansson_private.h"
+
+/* C89 allows these to be macros */
+#undef malloc
+#undef realloc
+#undef free
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+/* Size classes are 8 bytes apart so that json_integer_t, json_real_t,
+   json_string_t, json_array_t, json_object_t and pairs with short keys
+   each get an exact fit. Anything larger goes to malloc. */
+#define POOL_GRANULE 8
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/* Free blocks a thread keeps per class before giving half back */
+#define POOL_CACHE_MAX 2048
+/* Blocks taken from the depot at a time */
+#define POOL_REFILL 128
+
+/* Every block is preceded by its class (1..POOL_CLASSES), or 0 for
+   blocks that came from malloc. Those have their size stored in the
+   word before, keeping the malloc alignment for the caller. */
+#define POOL_LARGE 0
+#define POOL_LARGE_HEADER (2 * sizeof(size_t))
+
+#define block_class(ptr_) (((size_t *)(ptr_))[-1])
+#define class_size(cls_) ((cls_) * POOL_GRANULE)
+#define size_to_class(size_) (((size_) + POOL_GRANULE - 1) / POOL_GRANULE)
+
+typedef struct pool_free {
+    struct pool_free *next;
+} pool_free_t;
+
+typedef struct {
+    pool_free_t *free[POOL_CLASSES + 1];
+    size_t count[POOL_CLASSES + 1];
+    int registered;
+} pool_cache_t;
+
+static JSON_THREAD_LOCAL pool_cache_t thread_cache;
+
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_free_t *depot[POOL_CLASSES + 1];
+static size_t depot_count[POOL_CLASSES + 1];
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+/* Move up to count blocks from the head of *from to *to. Returns the
+   number of blocks moved. */
+static size_t move_blocks(pool_free_t **from, pool_free_t **to, size_t count) {
+    size_t moved = 0;
+
+    while (*from && moved < count) {
+        pool_free_t *block = *from;
+        *from = block->next;
+        block->next = *to;
+        *to = block;
+        moved++;
+    }
+
+    return moved;
+}
+
+static void cache_release(void *data) {
+    pool_cache_t *cache = data;
+    size_t cls, moved;
+
+    pthread_mutex_lock(&depot_lock);
+    for (cls = 1; cls <= POOL_CLASSES; cls++) {
+        moved = move_blocks(&cache->free[cls], &depot[cls], (size_t)-1);
+        depot_count[cls] += moved;
+        cache->count[cls] = 0;
+    }
+    pthread_mutex_unlock(&depot_lock);
+
+    cache->registered = 0;
+}
+
+static void make_cache_key(void) { pthread_key_create(&cache_key, cache_release); }
+
+static pool_cache_t *get_cache(void) {
+    pool_cache_t *cache = &thread_cache;
+
+    if (!cache->registered) {
+        /* Hand the cache to the depot when the thread exits */
+        pthread_once(&key_once, make_cache_key);
+        pthread_setspecific(cache_key, cache);
+        cache->registered = 1;
+    }
+
+    return cache;
+}
+
+static int cache_refill(pool_cache_t *cache, size_t cls) {
+    size_t block_size = sizeof(size_t) + class_size(cls);
+    size_t i, n;
+    char *slab;
+
+    pthread_mutex_lock(&depot_lock);
+    if (depot[cls]) {
+        n = move_blocks(&depot[cls], &cache->free[cls], POOL_REFILL);
+        depot_count[cls] -= n;
+        pthread_mutex_unlock(&depot_lock);
+        cache->count[cls] += n;
+        return 0;
+    }
+    pthread_mutex_unlock(&depot_lock);
+
+    slab = malloc(POOL_SLAB_SIZE);
+    if (!slab)
+        return -1;
+
+    n = POOL_SLAB_SIZE / block_size;
+    for (i = 0; i < n; i++) {
+        size_t *header = (size_t *)(slab + i * block_size);
+        pool_free_t *block = (pool_free_t *)(header + 1);
+
+        *header = cls;
+        block->next = cache->free[cls];
+        cache->free[cls] = block;
+    }
+    cache->count[cls] += n;
+
+    return 0;
+}
+
+static void cache_spill(pool_cache_t *cache, size_t cls) {
+    size_t moved;
+
+    pthread_mutex_lock(&depot_lock);
+    moved = move_blocks(&cache->free[cls], &depot[cls], POOL_CACHE_MAX / 2);
+    depot_count[cls] += moved;
+    pthread_mutex_unlock(&depot_lock);
+
+    cache->count[cls] -= moved;
+}
+
+static void *large_malloc(size_t size) {
+    size_t *header;
+
+    if (size > (size_t)-1 - POOL_LARGE_HEADER)
+        return NULL;
+
+    header = malloc(POOL_LARGE_HEADER + size);
+    if (!header)
+        return NULL;
+
+    header[0] = size;
+    header[1] = POOL_LARGE;
+    return header + 2;
+}
+
+void *json_pool_malloc(size_t size) {
+    pool_cache_t *cache;
+    pool_free_t *block;
+    size_t cls;
+
+    if (size > POOL_MAX_SIZE)
+        return large_malloc(size);
+
+    cls = size ? size_to_class(size) : 1;
+    cache = get_cache();
+
+    if (!cache->free[cls] && cache_refill(cache, cls))
+        return NULL;
+
+    block = cache->free[cls];
+    cache->free[cls] = block->next;
+    cache->count[cls]--;
+
+    return block;
+}
+
+void json_pool_free(void *ptr) {
+    pool_cache_t *cache;
+    pool_free_t *block;
+    size_t cls;
+
+    if (!ptr)
+        return;
+
+    cls = block_class(ptr);
+    if (cls == POOL_LARGE) {
+        free((char *)ptr - POOL_LARGE_HEADER);
+        return;
+    }
+
+    cache = get_cache();
+    block = ptr;
+    block->next = cache->free[cls];
+    cache->free[cls] = block;
+
+    if (++cache->count[cls] > POOL_CACHE_MAX)
+        cache_spill(cache, cls);
+}
+
+void *json_pool_realloc(void *ptr, size_t size) {
+    size_t cls, old_size;
+    void *new_ptr;
+
+    if (!ptr)
+        return json_pool_malloc(size);
+
+    if (!size) {
+        json_pool_free(ptr);
+        return NULL;
+    }
+
+    cls = block_class(ptr);
+    if (cls == POOL_LARGE) {
+        size_t *header = (size_t *)((char *)ptr - POOL_LARGE_HEADER);
+
+        if (size > POOL_MAX_SIZE) {
+            if (size > (size_t)-1 - POOL_LARGE_HEADER)
+                return NULL;
+
+            header = realloc(header, POOL_LARGE_HEADER + size);
+            if (!header)
+                return NULL;
+
+            header[0] = size;
+            return header + 2;
+        }
+        old_size = header[0];
+    } else {
+        old_size = class_size(cls);
+        if (size <= old_size)
+            return ptr;
+    }
+
+    new_ptr = json_pool_malloc(size);
+    if (!new_ptr)
+        return NULL;
+
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    json_pool_free(ptr);
+    return new_ptr;
+}
+
+#else /* _WIN32 */
+
+/* No pooling without pthreads; forward to the C library so the
+   functions can still be installed unconditionally. */
+void *json_pool_malloc(size_t size) { return malloc(size); }
+
+void *json_pool_realloc(void *ptr, size_t size) { return realloc(ptr, size); }
+
+void json_pool_free(void *ptr) { free(ptr); }
+
+#endif
@@ -18,6 +18,11 @@
 #define STRBUFFER_FACTOR   2
 #define STRBUFFER_SIZE_MAX ((size_t)(-1))
 
+/* Buffers a thread keeps between uses, and the capacity one is
+   trimmed back to when it is returned larger than that */
+#define STRBUFFER_POOL_SIZE 4
+#define STRBUFFER_POOL_TRIM (64 * 1024)
+
 int strbuffer_init(strbuffer_t *strbuff) {
     strbuff->size = STRBUFFER_MIN_SIZE;
     strbuff->length = 0;
@@ -40,6 +45,89 @@ void strbuffer_close(strbuffer_t *strbuff) {
     strbuff->value = NULL;
 }
 
+#ifndef _WIN32
+
+#include <pthread.h>
+
+typedef struct {
+    char *value[STRBUFFER_POOL_SIZE];
+    size_t size[STRBUFFER_POOL_SIZE];
+    size_t count;
+    int registered;
+} strbuffer_pool_t;
+
+static JSON_THREAD_LOCAL strbuffer_pool_t thread_pool;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pool_key;
+
+static void pool_release(void *data) {
+    strbuffer_pool_t *pool = data;
+
+    while (pool->count)
+        jsonp_free(pool->value[--pool->count]);
+    pool->registered = 0;
+}
+
+static void make_pool_key(void) { pthread_key_create(&pool_key, pool_release); }
+
+int strbuffer_init_pooled(strbuffer_t *strbuff) {
+    strbuffer_pool_t *pool = &thread_pool;
+
+    if (!pool->count)
+        return strbuffer_init(strbuff);
+
+    pool->count--;
+    strbuff->value = pool->value[pool->count];
+    strbuff->size = pool->size[pool->count];
+    strbuff->length = 0;
+    strbuff->value[0] = '\0';
+    return 0;
+}
+
+void strbuffer_close_pooled(strbuffer_t *strbuff) {
+    strbuffer_pool_t *pool = &thread_pool;
+
+    if (!strbuff->value || pool->count == STRBUFFER_POOL_SIZE) {
+        strbuffer_close(strbuff);
+        return;
+    }
+
+    if (strbuff->size > STRBUFFER_POOL_TRIM) {
+        /* one huge document shouldn't pin its buffer for good */
+        char *value = jsonp_realloc(strbuff->value, strbuff->size, STRBUFFER_POOL_TRIM);
+        if (!value) {
+            strbuffer_close(strbuff);
+            return;
+        }
+        strbuff->value = value;
+        strbuff->size = STRBUFFER_POOL_TRIM;
+    }
+
+    if (!pool->registered) {
+        /* free the pooled buffers when the thread exits */
+        pthread_once(&key_once, make_pool_key);
+        pthread_setspecific(pool_key, pool);
+        pool->registered = 1;
+    }
+
+    pool->value[pool->count] = strbuff->value;
+    pool->size[pool->count] = strbuff->size;
+    pool->count++;
+
+    strbuff->size = 0;
+    strbuff->length = 0;
+    strbuff->value = NULL;
+}
+
+#else /* _WIN32 */
+
+int strbuffer_init_pooled(strbuffer_t *strbuff) { return strbuffer_init(strbuff); }
+
+void strbuffer_close_pooled(strbuffer_t *strbuff) { strbuffer_close(strbuff); }
+
+#endif
+
 void strbuffer_clear(strbuffer_t *strbuff) {
     strbuff->length = 0;
     strbuff->value[0] = '\0';
@@ -20,6 +20,12 @@ typedef struct {
 int strbuffer_init(strbuffer_t *strbuff) JANSSON_ATTRS((warn_unused_result));
 void strbuffer_close(strbuffer_t *strbuff);
 
+/* Like strbuffer_init() and strbuffer_close(), but the storage comes
+   from and goes back to a small per-thread pool, keeping the capacity
+   it grew to. Don't steal the value of a pooled buffer. */
+int strbuffer_init_pooled(strbuffer_t *strbuff) JANSSON_ATTRS((warn_unused_result));
+void strbuffer_close_pooled(strbuffer_t *strbuff);
+
 void strbuffer_clear(strbuffer_t *strbuff);
 
 const char *strbuffer_value(const strbuffer_t *strbuff);
@@ -0,0 +1,918 @@
+/*
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/* Tapes: a value flattened into 64-bit words followed by a string
+   arena, read in place without parsing. Each word holds its type in
+   the top byte and a payload below it:
+
+     '{' '['    index just past the matching end word
+     '}' ']'    number of members or elements
+     '"'        offset of the string in the arena
+     'l' 'd'    nothing, the next word holds the integer or real bits
+     't' 'f' 'n'
+
+   Object members are a key string followed by the value. An arena
+   string is its 64-bit length, the bytes and a '\0'; short strings
+   are stored once however often they occur. Everything is in native
+   byte order, the magic number tells if a tape was written on another
+   kind of machine. Loading checks the structure once, after that the
+   accessors trust it. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jansson.h"
+#include "jansson_private.h"
+#include "strbuffer.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define TAPE_MAGIC UINT64_C(0x3165706174534a4a) /* "JJStape1" on little endian */
+#define TAPE_MAGIC_SWAPPED UINT64_C(0x4a4a537461706531)
+
+#define TAPE_OBJECT '{'
+#define TAPE_ARRAY '['
+#define TAPE_END_OBJECT '}'
+#define TAPE_END_ARRAY ']'
+#define TAPE_STRING '"'
+#define TAPE_INTEGER 'l'
+#define TAPE_REAL 'd'
+#define TAPE_TRUE 't'
+#define TAPE_FALSE 'f'
+#define TAPE_NULL 'n'
+
+#define TAPE_PAYLOAD_MASK ((UINT64_C(1) << 56) - 1)
+#define tape_word(type, payload) (((uint64_t)(type) << 56) | (uint64_t)(payload))
+#define tape_type(word) ((int)((word) >> 56))
+#define tape_payload(word) ((size_t)((word)&TAPE_PAYLOAD_MASK))
+
+/* strings up to this long are shared in the arena */
+#define TAPE_SHARED_MAX 32
+
+typedef struct {
+    uint64_t magic;
+    uint64_t words;
+    uint64_t arena;
+} tape_header_t;
+
+struct json_tape {
+    const uint64_t *words;
+    size_t count;
+    const char *arena;
+    size_t arena_size;
+    void *map; /* munmapped or freed by json_tape_free() */
+    size_t map_size;
+};
+
+/*** writing ***/
+
+typedef struct {
+    uint64_t *words;
+    size_t count;
+    size_t size;
+    strbuffer_t arena;
+    size_t *shared; /* open addressing, arena offset + 1 of short strings */
+    size_t shared_count;
+    size_t shared_size;
+} tape_out_t;
+
+static int tape_push(tape_out_t *out, uint64_t word) {
+    if (out->count == out->size) {
+        size_t size = out->size ? out->size * 2 : 256;
+        uint64_t *words =
+            jsonp_realloc(out->words, out->size * sizeof(uint64_t), size * sizeof(uint64_t));
+        if (!words)
+            return -1;
+        out->words = words;
+        out->size = size;
+    }
+    out->words[out->count++] = word;
+    return 0;
+}
+
+static size_t string_hash(const char *value, size_t len) {
+    size_t hash = 2166136261u, i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)value[i]) * 16777619u;
+    return hash;
+}
+
+static int arena_equal(const strbuffer_t *arena, size_t offset, const char *value,
+                       size_t len) {
+    uint64_t length;
+
+    memcpy(&length, arena->value + offset, sizeof(length));
+    return length == len && !memcmp(arena->value + offset + sizeof(length), value, len);
+}
+
+static int shared_grow(tape_out_t *out) {
+    size_t size = out->shared_size ? out->shared_size * 2 : 64, i;
+    size_t *shared = jsonp_malloc(size * sizeof(size_t));
+
+    if (!shared)
+        return -1;
+    memset(shared, 0, size * sizeof(size_t));
+
+    for (i = 0; i < out->shared_size; i++) {
+        size_t slot, offset = out->shared[i];
+        uint64_t length;
+
+        if (!offset)
+            continue;
+        memcpy(&length, out->arena.value + offset - 1, sizeof(length));
+        slot = string_hash(out->arena.value + offset - 1 + sizeof(length), length);
+        while (shared[slot & (size - 1)])
+            slot++;
+        shared[slot & (size - 1)] = offset;
+    }
+
+    jsonp_free(out->shared);
+    out->shared = shared;
+    out->shared_size = size;
+    return 0;
+}
+
+static int tape_string(tape_out_t *out, const char *value, size_t len) {
+    uint64_t length = len;
+    size_t offset = out->arena.length, slot = 0;
+
+    if (len <= TAPE_SHARED_MAX) {
+        if (out->shared_count * 2 >= out->shared_size && shared_grow(out))
+            return -1;
+
+        slot = string_hash(value, len);
+        while (out->shared[slot & (out->shared_size - 1)]) {
+            size_t found = out->shared[slot & (out->shared_size - 1)] - 1;
+            if (arena_equal(&out->arena, found, value, len))
+                return tape_push(out, tape_word(TAPE_STRING, found));
+            slot++;
+        }
+    }
+
+    if (offset > TAPE_PAYLOAD_MASK ||
+        strbuffer_append_bytes(&out->arena, (const char *)&length, sizeof(length)) ||
+        strbuffer_append_bytes(&out->arena, value, len) ||
+        strbuffer_append_bytes(&out->arena, "", 1))
+        return -1;
+
+    if (len <= TAPE_SHARED_MAX) {
+        out->shared[slot & (out->shared_size - 1)] = offset + 1;
+        out->shared_count++;
+    }
+    return tape_push(out, tape_word(TAPE_STRING, offset));
+}
+
+static int tape_integer(tape_out_t *out, json_int_t value) {
+    return tape_push(out, tape_word(TAPE_INTEGER, 0)) ||
+           tape_push(out, (uint64_t)(int64_t)value);
+}
+
+static int tape_real(tape_out_t *out, double value) {
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return tape_push(out, tape_word(TAPE_REAL, 0)) || tape_push(out, bits);
+}
+
+static int encode(const json_t *json, parents_t *parents, tape_out_t *out) {
+    size_t start = out->count;
+
+    if (!json)
+        return -1;
+
+    switch (json_typeof(json)) {
+        case JSON_NULL:
+            return tape_push(out, tape_word(TAPE_NULL, 0));
+
+        case JSON_TRUE:
+            return tape_push(out, tape_word(TAPE_TRUE, 0));
+
+        case JSON_FALSE:
+            return tape_push(out, tape_word(TAPE_FALSE, 0));
+
+        case JSON_INTEGER:
+            return tape_integer(out, json_integer_value(json));
+
+        case JSON_REAL:
+            return tape_real(out, json_real_value(json));
+
+        case JSON_STRING:
+            return tape_string(out, json_string_value(json), json_string_length(json));
+
+        case JSON_ARRAY: {
+            size_t i, n = json_array_size(json);
+
+            if (jsonp_loop_check(parents, json) || tape_push(out, tape_word(TAPE_ARRAY, 0)))
+                return -1;
+
+            for (i = 0; i < n; i++) {
+                json_int_t integer;
+                double real;
+                int res;
+
+                /* don't create json_t values for packed arrays */
+                switch (jsonp_array_packed_value(json, i, &integer, &real)) {
+                    case ARRAY_PACKED_INTEGER:
+                        res = tape_integer(out, integer);
+                        break;
+                    case ARRAY_PACKED_REAL:
+                        res = tape_real(out, real);
+                        break;
+                    default:
+                        res = encode(json_array_get(json, i), parents, out);
+                        break;
+                }
+                if (res)
+                    return -1;
+            }
+
+            if (tape_push(out, tape_word(TAPE_END_ARRAY, n)))
+                return -1;
+            out->words[start] |= out->count;
+
+            jsonp_loop_leave(parents);
+            return 0;
+        }
+
+        case JSON_OBJECT: {
+            void *iter;
+
+            if (jsonp_loop_check(parents, json) ||
+                tape_push(out, tape_word(TAPE_OBJECT, 0)))
+                return -1;
+
+            for (iter = json_object_iter((json_t *)json); iter;
+                 iter = json_object_iter_next((json_t *)json, iter)) {
+                if (tape_string(out, json_object_iter_key(iter),
+                                json_object_iter_key_len(iter)) ||
+                    encode(json_object_iter_value(iter), parents, out))
+                    return -1;
+            }
+
+            if (tape_push(out, tape_word(TAPE_END_OBJECT, json_object_size(json))))
+                return -1;
+            out->words[start] |= out->count;
+
+            jsonp_loop_leave(parents);
+            return 0;
+        }
+
+        default:
+            return -1;
+    }
+}
+
+static void tape_out_close(tape_out_t *out) {
+    jsonp_free(out->words);
+    jsonp_free(out->shared);
+    strbuffer_close(&out->arena);
+}
+
+static int encode_root(const json_t *json, tape_out_t *out) {
+    parents_t parents;
+    int res;
+
+    memset(out, 0, sizeof(tape_out_t));
+    if (strbuffer_init(&out->arena))
+        return -1;
+
+    jsonp_parents_init(&parents);
+    res = encode(json, &parents, out);
+    jsonp_parents_close(&parents);
+
+    if (res)
+        tape_out_close(out);
+    return res;
+}
+
+static void tape_header(const tape_out_t *out, tape_header_t *header) {
+    header->magic = TAPE_MAGIC;
+    header->words = out->count;
+    header->arena = out->arena.length;
+}
+
+char *json_tape_dumps(const json_t *json, size_t *length) {
+    tape_out_t out;
+    tape_header_t header;
+    size_t words, size;
+    char *result;
+
+    if (encode_root(json, &out))
+        return NULL;
+
+    tape_header(&out, &header);
+    words = out.count * sizeof(uint64_t);
+    size = sizeof(header) + words + out.arena.length;
+
+    result = jsonp_malloc(size);
+    if (result) {
+        memcpy(result, &header, sizeof(header));
+        memcpy(result + sizeof(header), out.words, words);
+        memcpy(result + sizeof(header) + words, out.arena.value, out.arena.length);
+        if (length)
+            *length = size;
+    }
+
+    tape_out_close(&out);
+    return result;
+}
+
+/* The tape is written next to path and renamed over it, so a reader
+   never maps a file that is still being written or is truncated
+   under it. */
+int json_tape_dump_file(const json_t *json, const char *path) {
+    tape_out_t out;
+    tape_header_t header;
+    FILE *output;
+    char *tmp;
+    int res = -1;
+
+    if (!path || encode_root(json, &out))
+        return -1;
+
+    tape_header(&out, &header);
+
+#ifndef _WIN32
+    {
+        static volatile size_t serial;
+        size_t len = strlen(path) + 64;
+        int fd = -1;
+
+        tmp = jsonp_malloc(len);
+        if (!tmp)
+            goto out;
+
+        while (fd == -1) {
+            /* unique among processes and threads, created like any
+               other file so the umask applies */
+#if JSON_HAVE_ATOMIC_BUILTINS
+            size_t n = __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED);
+#else
+            size_t n = serial++;
+#endif
+            snprintf(tmp, len, "%s.%ld.%lu", path, (long)getpid(), (unsigned long)n);
+            fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if (fd == -1 && errno != EEXIST) {
+                jsonp_free(tmp);
+                goto out;
+            }
+        }
+
+        output = fdopen(fd, "wb");
+        if (!output) {
+            close(fd);
+            unlink(tmp);
+            jsonp_free(tmp);
+            goto out;
+        }
+    }
+#else
+    tmp = NULL;
+    output = fopen(path, "wb");
+    if (!output)
+        goto out;
+#endif
+
+    if (fwrite(&header, sizeof(header), 1, output) == 1 &&
+        fwrite(out.words, sizeof(uint64_t), out.count, output) == out.count &&
+        fwrite(out.arena.value, 1, out.arena.length, output) == out.arena.length)
+        res = 0;
+
+    if (fclose(output))
+        res = -1;
+
+    if (tmp) {
+        if (res || rename(tmp, path)) {
+            unlink(tmp);
+            res = -1;
+        }
+        jsonp_free(tmp);
+    }
+
+out:
+    tape_out_close(&out);
+    return res;
+}
+
+/*** loading ***/
+
+typedef struct {
+    size_t start;
+    size_t children;
+} tape_open_t;
+
+static int tape_check(json_tape_t *tape, json_error_t *error) {
+    tape_open_t *stack = NULL;
+    size_t depth = 0, size = 0, i = 0;
+    const char *msg = NULL;
+
+    if (!tape->count) {
+        msg = "empty tape";
+        goto out;
+    }
+
+    while (i < tape->count) {
+        uint64_t word = tape->words[i];
+        int type = tape_type(word);
+        size_t payload = tape_payload(word);
+
+        if (type == TAPE_END_OBJECT || type == TAPE_END_ARRAY) {
+            tape_open_t *top = depth ? &stack[depth - 1] : NULL;
+            int open = type == TAPE_END_OBJECT ? TAPE_OBJECT : TAPE_ARRAY;
+
+            if (!top || tape_type(tape->words[top->start]) != open ||
+                tape_payload(tape->words[top->start]) != i + 1 ||
+                payload != (type == TAPE_END_OBJECT ? top->children / 2 : top->children) ||
+                (type == TAPE_END_OBJECT && top->children % 2)) {
+                msg = "unbalanced container";
+                goto out;
+            }
+            depth--;
+            i++;
+        } else {
+            if (depth) {
+                tape_open_t *top = &stack[depth - 1];
+
+                if (tape_type(tape->words[top->start]) == TAPE_OBJECT &&
+                    top->children % 2 == 0 && type != TAPE_STRING) {
+                    msg = "object key is not a string";
+                    goto out;
+                }
+                top->children++;
+            } else if (i) {
+                msg = "more than one root value";
+                goto out;
+            }
+
+            switch (type) {
+                case TAPE_OBJECT:
+                case TAPE_ARRAY:
+                    if (depth >= JSON_PARSER_MAX_DEPTH) {
+                        msg = "maximum nesting depth exceeded";
+                        goto out;
+                    }
+                    if (depth == size) {
+                        size_t new_size = size ? size * 2 : 16;
+                        tape_open_t *new_stack =
+                            jsonp_realloc(stack, size * sizeof(tape_open_t),
+                                          new_size * sizeof(tape_open_t));
+                        if (!new_stack) {
+                            msg = "out of memory";
+                            goto out;
+                        }
+                        stack = new_stack;
+                        size = new_size;
+                    }
+                    stack[depth].start = i;
+                    stack[depth].children = 0;
+                    depth++;
+                    i++;
+                    break;
+
+                case TAPE_STRING: {
+                    uint64_t length;
+
+                    if (payload > tape->arena_size ||
+                        tape->arena_size - payload < sizeof(length) + 1) {
+                        msg = "string outside the arena";
+                        goto out;
+                    }
+                    memcpy(&length, tape->arena + payload, sizeof(length));
+                    if (length > tape->arena_size - payload - sizeof(length) - 1 ||
+                        tape->arena[payload + sizeof(length) + length] != '\0') {
+                        msg = "string outside the arena";
+                        goto out;
+                    }
+                    i++;
+                    break;
+                }
+
+                case TAPE_INTEGER:
+                case TAPE_REAL:
+                    if (i + 1 >= tape->count) {
+                        msg = "number cut short";
+                        goto out;
+                    }
+                    i += 2;
+                    break;
+
+                case TAPE_TRUE:
+                case TAPE_FALSE:
+                case TAPE_NULL:
+                    i++;
+                    break;
+
+                default:
+                    msg = "invalid word";
+                    goto out;
+            }
+        }
+    }
+
+    if (depth)
+        msg = "unbalanced container";
+
+out:
+    jsonp_free(stack);
+    if (msg) {
+        jsonp_error_set(error, -1, -1, i * sizeof(uint64_t), json_error_invalid_format,
+                        "corrupt tape: %s", msg);
+        return -1;
+    }
+    return 0;
+}
+
+static json_tape_t *tape_open(const char *buffer, size_t buflen, json_error_t *error) {
+    tape_header_t header;
+    json_tape_t *tape;
+
+    if (buflen < sizeof(header)) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_format, "not a tape");
+        return NULL;
+    }
+
+    memcpy(&header, buffer, sizeof(header));
+    if (header.magic != TAPE_MAGIC) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_format,
+                        header.magic == TAPE_MAGIC_SWAPPED
+                            ? "tape has the wrong byte order"
+                            : "not a tape");
+        return NULL;
+    }
+
+    if (header.words > (buflen - sizeof(header)) / sizeof(uint64_t) ||
+        header.arena != buflen - sizeof(header) - header.words * sizeof(uint64_t)) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_format,
+                        "tape size doesn't match its header");
+        return NULL;
+    }
+
+    tape = jsonp_malloc(sizeof(json_tape_t));
+    if (!tape) {
+        jsonp_error_set(error, -1, -1, 0, json_error_out_of_memory, "out of memory");
+        return NULL;
+    }
+
+    tape->words = (const uint64_t *)(buffer + sizeof(header));
+    tape->count = (size_t)header.words;
+    tape->arena = buffer + sizeof(header) + tape->count * sizeof(uint64_t);
+    tape->arena_size = (size_t)header.arena;
+    tape->map = NULL;
+    tape->map_size = 0;
+
+    if (tape_check(tape, error)) {
+        jsonp_free(tape);
+        return NULL;
+    }
+    return tape;
+}
+
+json_tape_t *json_tape_loadb(const char *buffer, size_t buflen, json_error_t *error) {
+    jsonp_error_init(error, "<buffer>");
+
+    if (!buffer || (uintptr_t)buffer % sizeof(uint64_t)) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "wrong arguments");
+        return NULL;
+    }
+
+    return tape_open(buffer, buflen, error);
+}
+
+json_tape_t *json_tape_load_file(const char *path, json_error_t *error) {
+    json_tape_t *tape;
+    char *buffer;
+    size_t size;
+
+    jsonp_error_init(error, path);
+
+    if (path == NULL) {
+        jsonp_error_set(error, -1, -1, 0, json_error_invalid_argument,
+                        "wrong arguments");
+        return NULL;
+    }
+
+#ifndef _WIN32
+    {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to open %s: %s", path, strerror(errno));
+            if (fd != -1)
+                close(fd);
+            return NULL;
+        }
+
+        size = (size_t)st.st_size;
+        if (size < sizeof(tape_header_t)) {
+            close(fd);
+            jsonp_error_set(error, -1, -1, 0, json_error_invalid_format, "not a tape");
+            return NULL;
+        }
+
+        buffer = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (buffer == MAP_FAILED) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to map %s: %s", path, strerror(errno));
+            return NULL;
+        }
+    }
+#else
+    {
+        FILE *fp = fopen(path, "rb");
+        long length;
+
+        if (!fp || fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 ||
+            fseek(fp, 0, SEEK_SET)) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to open %s: %s", path, strerror(errno));
+            if (fp)
+                fclose(fp);
+            return NULL;
+        }
+
+        size = (size_t)length;
+        buffer = jsonp_malloc(size ? size : 1);
+        if (!buffer || fread(buffer, 1, size, fp) != size) {
+            jsonp_error_set(error, -1, -1, 0, json_error_cannot_open_file,
+                            "unable to read %s", path);
+            jsonp_free(buffer);
+            fclose(fp);
+            return NULL;
+        }
+        fclose(fp);
+    }
+#endif
+
+    tape = tape_open(buffer, size, error);
+    if (!tape) {
+#ifndef _WIN32
+        munmap(buffer, size);
+#else
+        jsonp_free(buffer);
+#endif
+        return NULL;
+    }
+
+    tape->map = buffer;
+    tape->map_size = size;
+    return tape;
+}
+
+void json_tape_free(json_tape_t *tape) {
+    if (!tape)
+        return;
+
+    if (tape->map) {
+#ifndef _WIN32
+        munmap(tape->map, tape->map_size);
+#else
+        jsonp_free(tape->map);
+#endif
+    }
+    jsonp_free(tape);
+}
+
+/*** accessors ***/
+
+#define tape_at(tape, value) (tape_type((tape)->words[value]))
+
+static int is_container(const json_tape_t *tape, size_t value, int type) {
+    return tape && value < tape->count && tape_at(tape, value) == type;
+}
+
+int json_tape_typeof(const json_tape_t *tape, size_t value) {
+    if (!tape || value >= tape->count)
+        return -1;
+
+    switch (tape_at(tape, value)) {
+        case TAPE_OBJECT:
+            return JSON_OBJECT;
+        case TAPE_ARRAY:
+            return JSON_ARRAY;
+        case TAPE_STRING:
+            return JSON_STRING;
+        case TAPE_INTEGER:
+            return JSON_INTEGER;
+        case TAPE_REAL:
+            return JSON_REAL;
+        case TAPE_TRUE:
+            return JSON_TRUE;
+        case TAPE_FALSE:
+            return JSON_FALSE;
+        case TAPE_NULL:
+            return JSON_NULL;
+        default:
+            /* an end word, not a value */
+            return -1;
+    }
+}
+
+size_t json_tape_size(const json_tape_t *tape, size_t value) {
+    if (!is_container(tape, value, TAPE_OBJECT) && !is_container(tape, value, TAPE_ARRAY))
+        return 0;
+
+    /* the end word holds the size */
+    return tape_payload(tape->words[tape_payload(tape->words[value]) - 1]);
+}
+
+size_t json_tape_child(const json_tape_t *tape, size_t value) {
+    if (!json_tape_size(tape, value))
+        return JSON_TAPE_NONE;
+    return value + 1;
+}
+
+size_t json_tape_next(const json_tape_t *tape, size_t value) {
+    size_t next;
+
+    if (!tape || value >= tape->count)
+        return JSON_TAPE_NONE;
+
+    switch (tape_at(tape, value)) {
+        case TAPE_OBJECT:
+        case TAPE_ARRAY:
+            next = tape_payload(tape->words[value]);
+            break;
+        case TAPE_INTEGER:
+        case TAPE_REAL:
+            next = value + 2;
+            break;
+        case TAPE_END_OBJECT:
+        case TAPE_END_ARRAY:
+            return JSON_TAPE_NONE;
+        default:
+            next = value + 1;
+            break;
+    }
+
+    if (next >= tape->count || tape_at(tape, next) == TAPE_END_OBJECT ||
+        tape_at(tape, next) == TAPE_END_ARRAY)
+        return JSON_TAPE_NONE;
+    return next;
+}
+
+size_t json_tape_array_get(const json_tape_t *tape, size_t array, size_t index) {
+    size_t value;
+
+    if (!is_container(tape, array, TAPE_ARRAY) || index >= json_tape_size(tape, array))
+        return JSON_TAPE_NONE;
+
+    value = array + 1;
+    while (index--)
+        value = json_tape_next(tape, value);
+    return value;
+}
+
+static const char *string_at(const json_tape_t *tape, size_t value, size_t *len) {
+    size_t offset;
+    uint64_t length;
+
+    if (len)
+        *len = 0;
+    if (!tape || value >= tape->count || tape_at(tape, value) != TAPE_STRING)
+        return NULL;
+
+    offset = tape_payload(tape->words[value]);
+    memcpy(&length, tape->arena + offset, sizeof(length));
+    if (len)
+        *len = (size_t)length;
+    return tape->arena + offset + sizeof(length);
+}
+
+size_t json_tape_object_getn(const json_tape_t *tape, size_t object, const char *key,
+                             size_t key_len) {
+    size_t member;
+
+    if (!is_container(tape, object, TAPE_OBJECT) || !key)
+        return JSON_TAPE_NONE;
+
+    for (member = json_tape_child(tape, object); member != JSON_TAPE_NONE;
+         member = json_tape_next(tape, json_tape_next(tape, member))) {
+        size_t len;
+        const char *name = string_at(tape, member, &len);
+
+        if (name && len == key_len && !memcmp(name, key, len))
+            return json_tape_next(tape, member);
+    }
+    return JSON_TAPE_NONE;
+}
+
+size_t json_tape_object_get(const json_tape_t *tape, size_t object, const char *key) {
+    if (!key)
+        return JSON_TAPE_NONE;
+    return json_tape_object_getn(tape, object, key, strlen(key));
+}
+
+const char *json_tape_string_value(const json_tape_t *tape, size_t value) {
+    return string_at(tape, value, NULL);
+}
+
+size_t json_tape_string_length(const json_tape_t *tape, size_t value) {
+    size_t len;
+
+    if (!string_at(tape, value, &len))
+        return 0;
+    return len;
+}
+
+json_int_t json_tape_integer_value(const json_tape_t *tape, size_t value) {
+    if (!tape || value >= tape->count || tape_at(tape, value) != TAPE_INTEGER)
+        return 0;
+    return (json_int_t)(int64_t)tape->words[value + 1];
+}
+
+double json_tape_real_value(const json_tape_t *tape, size_t value) {
+    double real;
+
+    if (!tape || value >= tape->count || tape_at(tape, value) != TAPE_REAL)
+        return 0.0;
+
+    memcpy(&real, &tape->words[value + 1], sizeof(real));
+    return real;
+}
+
+double json_tape_number_value(const json_tape_t *tape, size_t value) {
+    if (json_tape_typeof(tape, value) == JSON_INTEGER)
+        return (double)json_tape_integer_value(tape, value);
+    return json_tape_real_value(tape, value);
+}
+
+json_t *json_tape_to_json(const json_tape_t *tape, size_t value) {
+    json_t *json;
+    size_t child;
+
+    switch (json_tape_typeof(tape, value)) {
+        case JSON_OBJECT:
+            json = json_object();
+            for (child = json_tape_child(tape, value); json && child != JSON_TAPE_NONE;
+                 child = json_tape_next(tape, json_tape_next(tape, child))) {
+                size_t len;
+                const char *key = string_at(tape, child, &len);
+
+                if (!key || json_object_setn_new_nocheck(
+                                json, key, len,
+                                json_tape_to_json(tape, json_tape_next(tape, child)))) {
+                    json_decref(json);
+                    return NULL;
+                }
+            }
+            return json;
+
+        case JSON_ARRAY:
+            json = json_array();
+            for (child = json_tape_child(tape, value); json && child != JSON_TAPE_NONE;
+                 child = json_tape_next(tape, child)) {
+                if (json_array_append_new(json, json_tape_to_json(tape, child))) {
+                    json_decref(json);
+                    return NULL;
+                }
+            }
+            return json;
+
+        case JSON_STRING: {
+            size_t len;
+            const char *string = string_at(tape, value, &len);
+
+            if (!string)
+                return NULL;
+            return json_stringn_nocheck(string, len);
+        }
+
+        case JSON_INTEGER:
+            return json_integer(json_tape_integer_value(tape, value));
+
+        case JSON_REAL:
+            return json_real(json_tape_real_value(tape, value));
+
+        case JSON_TRUE:
+            return json_true();
+
+        case JSON_FALSE:
+            return json_false();
+
+        case JSON_NULL:
+            return json_null();
+
+        default:
+            return NULL;
+    }
+}
@@ -37,24 +37,53 @@ static JSON_INLINE int isnan(double x) { return x != x; }
 static JSON_INLINE int isinf(double x) { return !isnan(x) && isnan(x - x); }
 #endif
 
-json_t *do_deep_copy(const json_t *json, hashtable_t *parents);
+json_t *do_deep_copy(const json_t *json, parents_t *parents);
 
 static JSON_INLINE void json_init(json_t *json, json_type type) {
     json->type = type;
+    json->flags = 0;
     json->refcount = 1;
 }
 
-int jsonp_loop_check(hashtable_t *parents, const json_t *json, char *key, size_t key_size,
-                     size_t *key_len_out) {
-    size_t key_len = snprintf(key, key_size, "%p", json);
+void jsonp_parents_init(parents_t *parents) {
+    parents->items = parents->inline_items;
+    parents->depth = 0;
+    parents->size = PARENTS_INLINE;
+}
 
-    if (key_len_out)
-        *key_len_out = key_len;
+void jsonp_parents_close(parents_t *parents) {
+    if (parents->items != parents->inline_items)
+        jsonp_free(parents->items);
+}
 
-    if (hashtable_get(parents, key, key_len))
-        return -1;
+int jsonp_loop_check(parents_t *parents, const json_t *json) {
+    size_t i;
+
+    /* the path is as long as the nesting is deep, usually short */
+    for (i = 0; i < parents->depth; i++) {
+        if (parents->items[i] == json)
+            return -1;
+    }
+
+    if (parents->depth == parents->size) {
+        size_t new_size = parents->size * 2;
+        const json_t **new_items;
+
+        if (new_size > (size_t)-1 / sizeof(json_t *))
+            return -1;
 
-    return hashtable_set(parents, key, key_len, json_null());
+        new_items = jsonp_malloc(new_size * sizeof(json_t *));
+        if (!new_items)
+            return -1;
+
+        memcpy(new_items, parents->items, parents->depth * sizeof(json_t *));
+        jsonp_parents_close(parents);
+        parents->items = new_items;
+        parents->size = new_size;
+    }
+
+    parents->items[parents->depth++] = json;
+    return 0;
 }
 
 /*** object ***/
@@ -81,6 +110,19 @@ json_t *json_object(void) {
     return &object->json;
 }
 
+json_t *json_object_with_capacity(size_t size) {
+    json_t *object = json_object();
+    if (!object)
+        return NULL;
+
+    if (hashtable_reserve(&json_to_object(object)->hashtable, size)) {
+        json_decref(object);
+        return NULL;
+    }
+
+    return object;
+}
+
 static void json_delete_object(json_object_t *object) {
     hashtable_close(&object->hashtable);
     jsonp_free(object);
@@ -104,13 +146,28 @@ json_t *json_object_get(const json_t *json, const char *key) {
 }
 
 json_t *json_object_getn(const json_t *json, const char *key, size_t key_len) {
+    return jsonp_object_getn_hashed(json, key, key_len, 0);
+}
+
+json_t *jsonp_object_getn_hashed(const json_t *json, const char *key, size_t key_len,
+                                 size_t hash) {
     json_object_t *object;
 
     if (!key || !json_is_object(json))
         return NULL;
 
     object = json_to_object(json);
-    return hashtable_get(&object->hashtable, key, key_len);
+    return hashtable_get_hashed(&object->hashtable, key, key_len, hash);
+}
+
+size_t jsonp_object_hash(const json_t *json, const char *key, size_t key_len) {
+    json_object_t *object;
+
+    if (!key || !json_is_object(json))
+        return 0;
+
+    object = json_to_object(json);
+    return hashtable_hash(&object->hashtable, key, key_len);
 }
 
 int json_object_set_new_nocheck(json_t *json, const char *key, json_t *value) {
@@ -123,18 +180,23 @@ int json_object_set_new_nocheck(json_t *json, const char *key, json_t *value) {
 
 int json_object_setn_new_nocheck(json_t *json, const char *key, size_t key_len,
                                  json_t *value) {
+    return jsonp_object_setn_new_hashed(json, key, key_len, 0, value);
+}
+
+int jsonp_object_setn_new_hashed(json_t *json, const char *key, size_t key_len,
+                                 size_t hash, json_t *value) {
     json_object_t *object;
 
     if (!value)
         return -1;
 
-    if (!key || !json_is_object(json) || json == value) {
+    if (!key || !json_is_object(json) || json_is_frozen(json) || json == value) {
         json_decref(value);
         return -1;
     }
     object = json_to_object(json);
 
-    if (hashtable_set(&object->hashtable, key, key_len, value)) {
+    if (hashtable_set_hashed(&object->hashtable, key, key_len, hash, value)) {
         json_decref(value);
         return -1;
     }
@@ -170,7 +232,7 @@ int json_object_del(json_t *json, const char *key) {
 int json_object_deln(json_t *json, const char *key, size_t key_len) {
     json_object_t *object;
 
-    if (!key || !json_is_object(json))
+    if (!key || !json_is_object(json) || json_is_frozen(json))
         return -1;
 
     object = json_to_object(json);
@@ -180,7 +242,7 @@ int json_object_deln(json_t *json, const char *key, size_t key_len) {
 int json_object_clear(json_t *json) {
     json_object_t *object;
 
-    if (!json_is_object(json))
+    if (!json_is_object(json) || json_is_frozen(json))
         return -1;
 
     object = json_to_object(json);
@@ -189,6 +251,10 @@ int json_object_clear(json_t *json) {
     return 0;
 }
 
+/* Hash cached by the pair of another object's key, so copying the key
+   into an object does not hash it again */
+#define key_hash(key) hashtable_iter_hash(json_object_key_to_iter(key))
+
 int json_object_update(json_t *object, json_t *other) {
     const char *key;
     size_t key_len;
@@ -198,7 +264,8 @@ int json_object_update(json_t *object, json_t *other) {
         return -1;
 
     json_object_keylen_foreach(other, key, key_len, value) {
-        if (json_object_setn_nocheck(object, key, key_len, value))
+        if (jsonp_object_setn_new_hashed(object, key, key_len, key_hash(key),
+                                         json_incref(value)))
             return -1;
     }
 
@@ -214,8 +281,9 @@ int json_object_update_existing(json_t *object, json_t *other) {
         return -1;
 
     json_object_keylen_foreach(other, key, key_len, value) {
-        if (json_object_getn(object, key, key_len))
-            json_object_setn_nocheck(object, key, key_len, value);
+        size_t hash = key_hash(key);
+        if (jsonp_object_getn_hashed(object, key, key_len, hash))
+            jsonp_object_setn_new_hashed(object, key, key_len, hash, json_incref(value));
     }
 
     return 0;
@@ -230,29 +298,29 @@ int json_object_update_missing(json_t *object, json_t *other) {
         return -1;
 
     json_object_keylen_foreach(other, key, key_len, value) {
-        if (!json_object_getn(object, key, key_len))
-            json_object_setn_nocheck(object, key, key_len, value);
+        size_t hash = key_hash(key);
+        if (!jsonp_object_getn_hashed(object, key, key_len, hash))
+            jsonp_object_setn_new_hashed(object, key, key_len, hash, json_incref(value));
     }
 
     return 0;
 }
 
-int do_object_update_recursive(json_t *object, json_t *other, hashtable_t *parents) {
+int do_object_update_recursive(json_t *object, json_t *other, parents_t *parents) {
     const char *key;
     size_t key_len;
     json_t *value;
-    char loop_key[LOOP_KEY_LEN];
     int res = 0;
-    size_t loop_key_len;
 
     if (!json_is_object(object) || !json_is_object(other))
         return -1;
 
-    if (jsonp_loop_check(parents, other, loop_key, sizeof(loop_key), &loop_key_len))
+    if (jsonp_loop_check(parents, other))
         return -1;
 
     json_object_keylen_foreach(other, key, key_len, value) {
-        json_t *v = json_object_getn(object, key, key_len);
+        size_t hash = key_hash(key);
+        json_t *v = jsonp_object_getn_hashed(object, key, key_len, hash);
 
         if (json_is_object(v) && json_is_object(value)) {
             if (do_object_update_recursive(v, value, parents)) {
@@ -260,26 +328,26 @@ int do_object_update_recursive(json_t *object, json_t *other, hashtable_t *paren
                 break;
             }
         } else {
-            if (json_object_setn_nocheck(object, key, key_len, value)) {
+            if (jsonp_object_setn_new_hashed(object, key, key_len, hash,
+                                             json_incref(value))) {
                 res = -1;
                 break;
             }
         }
     }
 
-    hashtable_del(parents, loop_key, loop_key_len);
+    jsonp_loop_leave(parents);
 
     return res;
 }
 
 int json_object_update_recursive(json_t *object, json_t *other) {
     int res;
-    hashtable_t parents_set;
+    parents_t parents;
 
-    if (hashtable_init(&parents_set))
-        return -1;
-    res = do_object_update_recursive(object, other, &parents_set);
-    hashtable_close(&parents_set);
+    jsonp_parents_init(&parents);
+    res = do_object_update_recursive(object, other, &parents);
+    jsonp_parents_close(&parents);
 
     return res;
 }
@@ -336,7 +404,7 @@ json_t *json_object_iter_value(void *iter) {
 }
 
 int json_object_iter_set_new(json_t *json, void *iter, json_t *value) {
-    if (!json_is_object(json) || !iter || !value) {
+    if (!json_is_object(json) || json_is_frozen(json) || !iter || !value) {
         json_decref(value);
         return -1;
     }
@@ -382,18 +450,17 @@ static json_t *json_object_copy(json_t *object) {
         return NULL;
 
     json_object_keylen_foreach(object, key, key_len, value)
-        json_object_setn_nocheck(result, key, key_len, value);
+        jsonp_object_setn_new_hashed(result, key, key_len, key_hash(key),
+                                     json_incref(value));
 
     return result;
 }
 
-static json_t *json_object_deep_copy(const json_t *object, hashtable_t *parents) {
+static json_t *json_object_deep_copy(const json_t *object, parents_t *parents) {
     json_t *result;
     void *iter;
-    char loop_key[LOOP_KEY_LEN];
-    size_t loop_key_len;
 
-    if (jsonp_loop_check(parents, object, loop_key, sizeof(loop_key), &loop_key_len))
+    if (jsonp_loop_check(parents, object))
         return NULL;
 
     result = json_object();
@@ -411,7 +478,8 @@ static json_t *json_object_deep_copy(const json_t *object, hashtable_t *parents)
         key_len = json_object_iter_key_len(iter);
         value = json_object_iter_value(iter);
 
-        if (json_object_setn_new_nocheck(result, key, key_len,
+        if (jsonp_object_setn_new_hashed(result, key, key_len,
+                                         hashtable_iter_hash(iter),
                                          do_deep_copy(value, parents))) {
             json_decref(result);
             result = NULL;
@@ -421,21 +489,30 @@ static json_t *json_object_deep_copy(const json_t *object, hashtable_t *parents)
     }
 
 out:
-    hashtable_del(parents, loop_key, loop_key_len);
+    jsonp_loop_leave(parents);
 
     return result;
 }
 
 /*** array ***/
 
-json_t *json_array(void) {
-    json_array_t *array = jsonp_malloc(sizeof(json_array_t));
+json_t *json_array(void) { return json_array_with_capacity(8); }
+
+json_t *json_array_with_capacity(size_t size) {
+    json_array_t *array;
+
+    if (size > (size_t)-1 / sizeof(json_t *))
+        return NULL;
+
+    array = jsonp_malloc(sizeof(json_array_t));
     if (!array)
         return NULL;
     json_init(&array->json, JSON_ARRAY);
 
     array->entries = 0;
-    array->size = 8;
+    array->size = size ? size : 1;
+    array->packed = ARRAY_UNPACKED;
+    array->values.reals = NULL;
 
     array->table = jsonp_malloc(array->size * sizeof(json_t *));
     if (!array->table) {
@@ -446,16 +523,165 @@ json_t *json_array(void) {
     return &array->json;
 }
 
+static size_t packed_item_size(int packed) {
+    return packed == ARRAY_PACKED_REAL ? sizeof(double) : sizeof(json_int_t);
+}
+
+static json_t *json_array_packed(int packed, const void *values, size_t n) {
+    json_array_t *array;
+    json_t *json;
+
+    json = json_array();
+    if (!json || !n)
+        return json;
+
+    array = json_to_array(json);
+    array->values.reals = jsonp_malloc(n * packed_item_size(packed));
+    if (!array->values.reals) {
+        json_decref(json);
+        return NULL;
+    }
+    memcpy(array->values.reals, values, n * packed_item_size(packed));
+
+    jsonp_free(array->table);
+    array->table = NULL;
+    array->packed = packed;
+    array->size = array->entries = n;
+
+    return json;
+}
+
+json_t *json_array_doubles(const double *values, size_t n) {
+    size_t i;
+
+    if (!values && n)
+        return NULL;
+
+    for (i = 0; i < n; i++) {
+        if (isnan(values[i]) || isinf(values[i]))
+            return NULL;
+    }
+
+    return json_array_packed(ARRAY_PACKED_REAL, values, n);
+}
+
+json_t *json_array_integers(const json_int_t *values, size_t n) {
+    if (!values && n)
+        return NULL;
+
+    return json_array_packed(ARRAY_PACKED_INTEGER, values, n);
+}
+
 static void json_delete_array(json_array_t *array) {
     size_t i;
 
-    for (i = 0; i < array->entries; i++)
-        json_decref(array->table[i]);
+    if (array->table) {
+        for (i = 0; i < array->entries; i++)
+            json_decref(array->table[i]);
+    }
 
     jsonp_free(array->table);
+    jsonp_free(array->values.reals);
     jsonp_free(array);
 }
 
+/* Concurrent readers of a packed array may race to create the same
+   element; the first value installed wins. */
+static void *load_ptr(void **slot) {
+#if JSON_HAVE_ATOMIC_BUILTINS
+    return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+#elif JSON_HAVE_SYNC_BUILTINS
+    __sync_synchronize();
+    return *(void *volatile *)slot;
+#else
+    return *slot;
+#endif
+}
+
+static void *install_ptr(void **slot, void *value) {
+#if JSON_HAVE_ATOMIC_BUILTINS
+    void *expected = NULL;
+
+    if (__atomic_compare_exchange_n(slot, &expected, value, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+        return value;
+    return expected;
+#elif JSON_HAVE_SYNC_BUILTINS
+    void *prev = __sync_val_compare_and_swap(slot, NULL, value);
+    return prev ? prev : value;
+#else
+    if (!*slot)
+        *slot = value;
+    return *slot;
+#endif
+}
+
+static json_t *packed_item(const json_array_t *array, size_t index) {
+    if (array->packed == ARRAY_PACKED_REAL)
+        return json_real(array->values.reals[index]);
+    else
+        return json_integer(array->values.integers[index]);
+}
+
+/* The element's json_t if it exists. Once created, it takes precedence
+   over the packed value as it may have been modified. */
+static json_t *array_cached(json_array_t *array, size_t index) {
+    json_t **table = load_ptr((void **)&array->table);
+
+    if (!table)
+        return NULL;
+    return load_ptr((void **)&table[index]);
+}
+
+static json_t *array_materialize(json_array_t *array, size_t index) {
+    json_t **table, *json, *installed;
+
+    table = load_ptr((void **)&array->table);
+    if (!table) {
+        json_t **new_table = jsonp_malloc(array->size * sizeof(json_t *));
+        if (!new_table)
+            return NULL;
+        memset(new_table, 0, array->size * sizeof(json_t *));
+
+        table = install_ptr((void **)&array->table, new_table);
+        if (table != new_table)
+            jsonp_free(new_table);
+    }
+
+    json = load_ptr((void **)&table[index]);
+    if (json)
+        return json;
+
+    json = packed_item(array, index);
+    if (!json)
+        return NULL;
+
+    installed = install_ptr((void **)&table[index], json);
+    if (installed != json)
+        json_decref(json);
+
+    return installed;
+}
+
+/* Turn a packed array into a regular one before modifying it */
+static int array_unpack(json_array_t *array) {
+    size_t i;
+
+    if (array->packed == ARRAY_UNPACKED)
+        return 0;
+
+    for (i = 0; i < array->entries; i++) {
+        if (!array_materialize(array, i))
+            return -1;
+    }
+
+    jsonp_free(array->values.reals);
+    array->values.reals = NULL;
+    array->packed = ARRAY_UNPACKED;
+
+    return 0;
+}
+
 size_t json_array_size(const json_t *json) {
     if (!json_is_array(json))
         return 0;
@@ -472,22 +698,109 @@ json_t *json_array_get(const json_t *json, size_t index) {
     if (index >= array->entries)
         return NULL;
 
+    if (array->packed != ARRAY_UNPACKED)
+        return array_materialize(array, index);
+
     return array->table[index];
 }
 
+int jsonp_array_packed_value(const json_t *json, size_t index, json_int_t *integer,
+                             double *real) {
+    json_array_t *array = json_to_array(json);
+
+    if (array->packed == ARRAY_UNPACKED || array_cached(array, index))
+        return ARRAY_UNPACKED;
+
+    if (array->packed == ARRAY_PACKED_REAL)
+        *real = array->values.reals[index];
+    else
+        *integer = array->values.integers[index];
+
+    return array->packed;
+}
+
+size_t json_array_get_doubles(const json_t *json, double *out, size_t n) {
+    json_array_t *array;
+    size_t i;
+
+    if (!json_is_array(json) || !out)
+        return 0;
+    array = json_to_array(json);
+
+    if (n > array->entries)
+        n = array->entries;
+
+    if (array->packed == ARRAY_PACKED_REAL && !load_ptr((void **)&array->table)) {
+        memcpy(out, array->values.reals, n * sizeof(double));
+        return n;
+    }
+
+    for (i = 0; i < n; i++) {
+        json_t *value = array_cached(array, i);
+
+        if (!value) {
+            out[i] = array->packed == ARRAY_PACKED_REAL
+                         ? array->values.reals[i]
+                         : (double)array->values.integers[i];
+            continue;
+        }
+
+        if (!json_is_number(value))
+            break;
+        out[i] = json_number_value(value);
+    }
+
+    return i;
+}
+
+size_t json_array_get_integers(const json_t *json, json_int_t *out, size_t n) {
+    json_array_t *array;
+    size_t i;
+
+    if (!json_is_array(json) || !out)
+        return 0;
+    array = json_to_array(json);
+
+    if (n > array->entries)
+        n = array->entries;
+
+    if (array->packed == ARRAY_PACKED_REAL)
+        return 0;
+
+    if (array->packed == ARRAY_PACKED_INTEGER && !load_ptr((void **)&array->table)) {
+        memcpy(out, array->values.integers, n * sizeof(json_int_t));
+        return n;
+    }
+
+    for (i = 0; i < n; i++) {
+        json_t *value = array_cached(array, i);
+
+        if (!value) {
+            out[i] = array->values.integers[i];
+            continue;
+        }
+
+        if (!json_is_integer(value))
+            break;
+        out[i] = json_integer_value(value);
+    }
+
+    return i;
+}
+
 int json_array_set_new(json_t *json, size_t index, json_t *value) {
     json_array_t *array;
 
     if (!value)
         return -1;
 
-    if (!json_is_array(json) || json == value) {
+    if (!json_is_array(json) || json_is_frozen(json) || json == value) {
         json_decref(value);
         return -1;
     }
     array = json_to_array(json);
 
-    if (index >= array->entries) {
+    if (index >= array->entries || array_unpack(array)) {
         json_decref(value);
         return -1;
     }
@@ -511,6 +824,9 @@ static json_t **json_array_grow(json_array_t *array, size_t amount) {
     size_t new_size;
     json_t **old_table, **new_table;
 
+    if (array_unpack(array))
+        return NULL;
+
     if (array->entries + amount <= array->size)
         return array->table;
 
@@ -528,13 +844,94 @@ static json_t **json_array_grow(json_array_t *array, size_t amount) {
     return array->table;
 }
 
+/* Append to the packed buffer if the array is packed with the same
+   type, or empty. Returns 1 if the value has to be appended as a
+   json_t instead. */
+static int array_append_packed(json_array_t *array, int packed, const void *value) {
+    size_t item_size = packed_item_size(packed);
+
+    if (array->packed != packed) {
+        void *values;
+
+        if (array->packed != ARRAY_UNPACKED || array->entries)
+            return 1;
+
+        /* empty regular array, switch to packed with the same capacity */
+        values = jsonp_malloc(array->size * item_size);
+        if (!values)
+            return -1;
+
+        jsonp_free(array->table);
+        array->table = NULL;
+        array->values.reals = values;
+        array->packed = packed;
+    }
+
+    if (array->entries == array->size) {
+        size_t new_size = max(8, array->size * 2);
+        void *new_values;
+
+        if (array->table) {
+            /* some elements have been materialized */
+            json_t **new_table =
+                jsonp_realloc(array->table, array->size * sizeof(json_t *),
+                              new_size * sizeof(json_t *));
+            if (!new_table)
+                return -1;
+            memset(new_table + array->size, 0,
+                   (new_size - array->size) * sizeof(json_t *));
+            array->table = new_table;
+        }
+
+        new_values = jsonp_realloc(array->values.reals, array->size * item_size,
+                                   new_size * item_size);
+        if (!new_values)
+            return -1;
+
+        array->values.reals = new_values;
+        array->size = new_size;
+    }
+
+    memcpy((char *)array->values.reals + array->entries * item_size, value,
+           item_size);
+    array->entries++;
+
+    return 0;
+}
+
+int jsonp_array_append_real(json_t *json, double value) {
+    int res;
+
+    if (!json_is_array(json) || isnan(value) || isinf(value))
+        return -1;
+
+    res = array_append_packed(json_to_array(json), ARRAY_PACKED_REAL, &value);
+    if (res == 1)
+        return json_array_append_new(json, json_real(value));
+
+    return res;
+}
+
+int jsonp_array_append_integer(json_t *json, json_int_t value) {
+    int res;
+
+    if (!json_is_array(json))
+        return -1;
+
+    res = array_append_packed(json_to_array(json), ARRAY_PACKED_INTEGER, &value);
+    if (res == 1)
+        return json_array_append_new(json, json_integer(value));
+
+    return res;
+}
+
 int json_array_append_new(json_t *json, json_t *value) {
     json_array_t *array;
 
     if (!value)
         return -1;
 
-    if (!json_is_array(json) || json == value) {
+    if (!json_is_array(json) || json_is_frozen(json) || json == value) {
         json_decref(value);
         return -1;
     }
@@ -557,7 +954,7 @@ int json_array_insert_new(json_t *json, size_t index, json_t *value) {
     if (!value)
         return -1;
 
-    if (!json_is_array(json) || json == value) {
+    if (!json_is_array(json) || json_is_frozen(json) || json == value) {
         json_decref(value);
         return -1;
     }
@@ -584,11 +981,11 @@ int json_array_insert_new(json_t *json, size_t index, json_t *value) {
 int json_array_remove(json_t *json, size_t index) {
     json_array_t *array;
 
-    if (!json_is_array(json))
+    if (!json_is_array(json) || json_is_frozen(json))
         return -1;
     array = json_to_array(json);
 
-    if (index >= array->entries)
+    if (index >= array->entries || array_unpack(array))
         return -1;
 
     json_decref(array->table[index]);
@@ -606,10 +1003,23 @@ int json_array_clear(json_t *json) {
     json_array_t *array;
     size_t i;
 
-    if (!json_is_array(json))
+    if (!json_is_array(json) || json_is_frozen(json))
         return -1;
     array = json_to_array(json);
 
+    if (array->packed != ARRAY_UNPACKED) {
+        /* drop the values, keep the materialized ones' table */
+        if (!array->table) {
+            array->table = jsonp_malloc(array->size * sizeof(json_t *));
+            if (!array->table)
+                return -1;
+            memset(array->table, 0, array->size * sizeof(json_t *));
+        }
+        jsonp_free(array->values.reals);
+        array->values.reals = NULL;
+        array->packed = ARRAY_UNPACKED;
+    }
+
     for (i = 0; i < array->entries; i++)
         json_decref(array->table[i]);
 
@@ -621,11 +1031,19 @@ int json_array_extend(json_t *json, json_t *other_json) {
     json_array_t *array, *other;
     size_t i;
 
-    if (!json_is_array(json) || !json_is_array(other_json))
+    if (!json_is_array(json) || json_is_frozen(json) || !json_is_array(other_json))
         return -1;
     array = json_to_array(json);
     other = json_to_array(other_json);
 
+    if (other->packed != ARRAY_UNPACKED) {
+        /* make sure all of other's elements exist */
+        for (i = 0; i < other->entries; i++) {
+            if (!array_materialize(other, i))
+                return -1;
+        }
+    }
+
     if (!json_array_grow(array, other->entries))
         return -1;
 
@@ -639,12 +1057,26 @@ int json_array_extend(json_t *json, json_t *other_json) {
 }
 
 static int json_array_equal(const json_t *array1, const json_t *array2) {
+    json_array_t *a1, *a2;
     size_t i, size;
 
     size = json_array_size(array1);
     if (size != json_array_size(array2))
         return 0;
 
+    a1 = json_to_array(array1);
+    a2 = json_to_array(array2);
+    if (a1->packed != ARRAY_UNPACKED && a1->packed == a2->packed &&
+        !load_ptr((void **)&a1->table) && !load_ptr((void **)&a2->table)) {
+        for (i = 0; i < size; i++) {
+            if (a1->packed == ARRAY_PACKED_REAL
+                    ? a1->values.reals[i] != a2->values.reals[i]
+                    : a1->values.integers[i] != a2->values.integers[i])
+                return 0;
+        }
+        return 1;
+    }
+
     for (i = 0; i < size; i++) {
         json_t *value1, *value2;
 
@@ -660,8 +1092,13 @@ static int json_array_equal(const json_t *array1, const json_t *array2) {
 
 static json_t *json_array_copy(json_t *array) {
     json_t *result;
+    json_array_t *a;
     size_t i;
 
+    a = json_to_array(array);
+    if (a->packed != ARRAY_UNPACKED && !load_ptr((void **)&a->table))
+        return json_array_packed(a->packed, a->values.reals, a->entries);
+
     result = json_array();
     if (!result)
         return NULL;
@@ -672,13 +1109,17 @@ static json_t *json_array_copy(json_t *array) {
     return result;
 }
 
-static json_t *json_array_deep_copy(const json_t *array, hashtable_t *parents) {
+static json_t *json_array_deep_copy(const json_t *array, parents_t *parents) {
     json_t *result;
+    json_array_t *a;
     size_t i;
-    char loop_key[LOOP_KEY_LEN];
-    size_t loop_key_len;
 
-    if (jsonp_loop_check(parents, array, loop_key, sizeof(loop_key), &loop_key_len))
+    /* numbers only, no loop check needed */
+    a = json_to_array(array);
+    if (a->packed != ARRAY_UNPACKED && !load_ptr((void **)&a->table))
+        return json_array_packed(a->packed, a->values.reals, a->entries);
+
+    if (jsonp_loop_check(parents, array))
         return NULL;
 
     result = json_array();
@@ -695,7 +1136,7 @@ static json_t *json_array_deep_copy(const json_t *array, hashtable_t *parents) {
     }
 
 out:
-    hashtable_del(parents, loop_key, loop_key_len);
+    jsonp_loop_leave(parents);
 
     return result;
 }
@@ -745,6 +1186,37 @@ json_t *jsonp_stringn_nocheck_own(const char *value, size_t len) {
     return string_create(value, len, 1);
 }
 
+/* A string whose value lives in a mapped file */
+typedef struct {
+    json_string_t string;
+    jsonp_mapping_t *mapping;
+} json_string_view_t;
+
+json_t *jsonp_stringn_nocheck_mapped(const char *value, size_t len,
+                                     jsonp_mapping_t *mapping) {
+    json_string_view_t *view = jsonp_malloc(sizeof(json_string_view_t));
+    if (!view)
+        return NULL;
+
+    json_init(&view->string.json, JSON_STRING);
+    view->string.json.flags = JSON_VALUE_MAPPED;
+    view->string.value = (char *)value;
+    view->string.length = len;
+    view->mapping = mapping;
+    JSON_INTERNAL_INCREF(mapping);
+
+    return &view->string.json;
+}
+
+static void string_release(json_string_t *string) {
+    if (string->json.flags & JSON_VALUE_MAPPED) {
+        json_string_view_t *view = container_of(string, json_string_view_t, string);
+        jsonp_mapping_decref(view->mapping);
+        string->json.flags &= ~JSON_VALUE_MAPPED;
+    } else
+        jsonp_free(string->value);
+}
+
 json_t *json_string(const char *value) {
     if (!value)
         return NULL;
@@ -784,7 +1256,7 @@ int json_string_setn_nocheck(json_t *json, const char *value, size_t len) {
     char *dup;
     json_string_t *string;
 
-    if (!json_is_string(json) || !value)
+    if (!json_is_string(json) || json_is_frozen(json) || !value)
         return -1;
 
     dup = jsonp_strndup(value, len);
@@ -792,7 +1264,7 @@ int json_string_setn_nocheck(json_t *json, const char *value, size_t len) {
         return -1;
 
     string = json_to_string(json);
-    jsonp_free(string->value);
+    string_release(string);
     string->value = dup;
     string->length = len;
 
@@ -814,7 +1286,7 @@ int json_string_setn(json_t *json, const char *value, size_t len) {
 }
 
 static void json_delete_string(json_string_t *string) {
-    jsonp_free(string->value);
+    string_release(string);
     jsonp_free(string);
 }
 
@@ -896,7 +1368,7 @@ json_int_t json_integer_value(const json_t *json) {
 }
 
 int json_integer_set(json_t *json, json_int_t value) {
-    if (!json_is_integer(json))
+    if (!json_is_integer(json) || json_is_frozen(json))
         return -1;
 
     json_to_integer(json)->value = value;
@@ -939,7 +1411,7 @@ double json_real_value(const json_t *json) {
 }
 
 int json_real_set(json_t *json, double value) {
-    if (!json_is_real(json) || isnan(value) || isinf(value))
+    if (!json_is_real(json) || json_is_frozen(json) || isnan(value) || isinf(value))
         return -1;
 
     json_to_real(json)->value = value;
@@ -971,17 +1443,17 @@ double json_number_value(const json_t *json) {
 /*** simple values ***/
 
 json_t *json_true(void) {
-    static json_t the_true = {JSON_TRUE, (size_t)-1};
+    static json_t the_true = {JSON_TRUE, 0, (size_t)-1};
     return &the_true;
 }
 
 json_t *json_false(void) {
-    static json_t the_false = {JSON_FALSE, (size_t)-1};
+    static json_t the_false = {JSON_FALSE, 0, (size_t)-1};
     return &the_false;
 }
 
 json_t *json_null(void) {
-    static json_t the_null = {JSON_NULL, (size_t)-1};
+    static json_t the_null = {JSON_NULL, 0, (size_t)-1};
     return &the_null;
 }
 
@@ -1069,19 +1541,205 @@ json_t *json_copy(json_t *json) {
     }
 }
 
+/*** frozen trees ***/
+
+/* Prepare json to be frozen: every value reachable from it must be
+   referenced by its container only, so that freeing the tree later
+   can't pull values out from under someone else. Other values are
+   replaced by copies. Packed array elements get their json_t now, as
+   creating them on first access would be a write by the reader. */
+static int freeze_own(json_t *json, parents_t *parents) {
+    int res = 0;
+
+    if (json_is_object(json)) {
+        void *iter;
+
+        if (jsonp_loop_check(parents, json))
+            return -1;
+
+        iter = json_object_iter(json);
+        while (iter && !res) {
+            json_t *value = json_object_iter_value(iter);
+
+            if (value->refcount != 1 && (value->refcount != (size_t)-1 ||
+                                         json_is_frozen(value))) {
+                value = json_deep_copy(value);
+                if (!value || json_object_iter_set_new(json, iter, value))
+                    res = -1;
+            }
+            if (!res)
+                res = freeze_own(value, parents);
+            iter = json_object_iter_next(json, iter);
+        }
+        jsonp_loop_leave(parents);
+    } else if (json_is_array(json)) {
+        size_t i;
+
+        if (jsonp_loop_check(parents, json))
+            return -1;
+
+        for (i = 0; i < json_array_size(json) && !res; i++) {
+            json_t *value = json_array_get(json, i);
+
+            if (!value)
+                res = -1;
+            else if (value->refcount != 1 && (value->refcount != (size_t)-1 ||
+                                              json_is_frozen(value))) {
+                value = json_deep_copy(value);
+                if (!value || json_array_set_new(json, i, value))
+                    res = -1;
+            }
+            if (!res)
+                res = freeze_own(value, parents);
+        }
+        jsonp_loop_leave(parents);
+    }
+
+    return res;
+}
+
+/* Set or clear the frozen state of a tree prepared by freeze_own().
+   Thawed values have the single reference of their container. */
+static void freeze_set(json_t *json, int frozen) {
+    size_t i;
+
+    /* true, false and null */
+    if (json->refcount == (size_t)-1 && !json_is_frozen(json))
+        return;
+
+    if (json_is_object(json)) {
+        void *iter = json_object_iter(json);
+
+        while (iter) {
+            freeze_set(json_object_iter_value(iter), frozen);
+            iter = json_object_iter_next(json, iter);
+        }
+    } else if (json_is_array(json)) {
+        for (i = 0; i < json_array_size(json); i++)
+            freeze_set(json_array_get(json, i), frozen);
+    }
+
+    if (frozen) {
+        json->refcount = (size_t)-1;
+        json->flags = JSON_VALUE_FROZEN | (json->flags & JSON_VALUE_MAPPED);
+    } else {
+        json->refcount = 1;
+        json->flags &= JSON_VALUE_MAPPED;
+    }
+}
+
+json_t *json_freeze(json_t *json) {
+    parents_t parents;
+    int res;
+
+    if (!json || json->refcount == (size_t)-1)
+        return json;
+
+    if (json->refcount != 1) {
+        json_t *copy = json_deep_copy(json);
+        json_decref(json);
+        json = copy;
+        if (!json)
+            return NULL;
+    }
+
+    jsonp_parents_init(&parents);
+    res = freeze_own(json, &parents);
+    jsonp_parents_close(&parents);
+
+    if (res) {
+        json_decref(json);
+        return NULL;
+    }
+
+    freeze_set(json, 1);
+    return json;
+}
+
+void jsonp_frozen_free(json_t *json) {
+    if (!json_is_frozen(json))
+        return;
+
+    freeze_set(json, 0);
+    json_decref(json);
+}
+
+/*** thread confinement ***/
+
+static int set_confined(json_t *json, int confined, parents_t *parents) {
+    int res = 0;
+
+    /* true, false and null are shared by all threads */
+    if (!json || json->refcount == (size_t)-1)
+        return 0;
+
+    if (confined)
+        json->flags |= JSON_VALUE_CONFINED;
+    else
+        json->flags &= ~JSON_VALUE_CONFINED;
+
+    if (json_is_object(json)) {
+        void *iter;
+
+        if (jsonp_loop_check(parents, json))
+            return -1;
+
+        iter = json_object_iter(json);
+        while (iter && !res) {
+            res = set_confined(json_object_iter_value(iter), confined, parents);
+            iter = json_object_iter_next(json, iter);
+        }
+        jsonp_loop_leave(parents);
+    } else if (json_is_array(json)) {
+        json_array_t *array = json_to_array(json);
+        size_t i;
+
+        if (jsonp_loop_check(parents, json))
+            return -1;
+
+        /* packed elements without a json_t yet get one that is shared */
+        for (i = 0; i < array->entries && !res; i++)
+            res = set_confined(array_cached(array, i), confined, parents);
+        jsonp_loop_leave(parents);
+    }
+
+    return res;
+}
+
+int json_confine(json_t *json) {
+    parents_t parents;
+    int res;
+
+    jsonp_parents_init(&parents);
+    res = set_confined(json, 1, &parents);
+    jsonp_parents_close(&parents);
+
+    return res;
+}
+
+int json_share(json_t *json) {
+    parents_t parents;
+    int res;
+
+    jsonp_parents_init(&parents);
+    res = set_confined(json, 0, &parents);
+    jsonp_parents_close(&parents);
+
+    return res;
+}
+
 json_t *json_deep_copy(const json_t *json) {
     json_t *res;
-    hashtable_t parents_set;
+    parents_t parents;
 
-    if (hashtable_init(&parents_set))
-        return NULL;
-    res = do_deep_copy(json, &parents_set);
-    hashtable_close(&parents_set);
+    jsonp_parents_init(&parents);
+    res = do_deep_copy(json, &parents);
+    jsonp_parents_close(&parents);
 
     return res;
 }
 
-json_t *do_deep_copy(const json_t *json, hashtable_t *parents) {
+json_t *do_deep_copy(const json_t *json, parents_t *parents) {
     if (!json)
         return NULL;
 
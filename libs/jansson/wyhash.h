@@ -0,0 +1,112 @@
+// clang-format off
+/*
+-------------------------------------------------------------------------------
+wyhash final version 4, by Wang Yi <godspeed_china@yeah.net>, released
+into the public domain (The Unlicense).
+
+Reduced to the one-shot hash used for object keys. It reads up to 16
+bytes of a short key with a few overlapping loads and finishes with a
+single 64x64->128 bit multiply, which makes it a lot cheaper than
+lookup3 on the short keys typical for JSON objects.
+
+Loads are done with memcpy() in host byte order, so the hash values
+differ between little- and big-endian machines. That is fine for a
+hash table that is never persisted.
+-------------------------------------------------------------------------------
+*/
+#ifndef WYHASH_H
+#define WYHASH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson_config.h> /* for JSON_INLINE */
+
+static const uint64_t wyp[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+                                0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+
+/* 64x64->128 bit multiply, low half into *a and high half into *b */
+static JSON_INLINE void wymum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl, lo, hi;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  *a = lo;
+  *b = hi;
+#endif
+}
+
+static JSON_INLINE uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static JSON_INLINE uint64_t wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static JSON_INLINE uint64_t wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static JSON_INLINE uint64_t wyr3(const uint8_t *p, size_t k) {
+  return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static JSON_INLINE uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t a, b;
+
+  seed ^= wymix(seed ^ wyp[0], wyp[1]);
+
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = wyr3(p, len);
+      b = 0;
+    } else
+      a = b = 0;
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+
+  a ^= wyp[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+#endif